@@ -0,0 +1,357 @@
+/*
+ *  ux-bench.c - Load generator for uxfs
+ *  Copyright (C) 2021  Wolfgang Zekoll, <wzk@quietsche-entchen.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+  /*
+   * Drives a uxfs mount that is served by ux-mock with system
+   * calls from several threads and reports operations per second
+   * and latency percentiles for each test:
+   *
+   *	stat	stat() of random files in /r
+   *	open	open(), read() to the end and close() of a file in /r
+   *	write	open(), write() and close() of a file in /w
+   *	readdir	opendir(), readdir() and closedir() of /r
+   *	churn	create and unlink a file, mkdir and rmdir a
+   *		directory in /u
+   *
+   * `make bench` mounts uxfs with ux-mock and runs all tests.
+   */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+
+#define	MAX_THREADS	256
+
+
+typedef struct _worker {
+    int		num;
+    int		(*op)(struct _worker *w);
+    unsigned int seed;
+    unsigned long count;
+
+    unsigned long long *lat;	/* ns */
+    unsigned long n, size;
+    unsigned long errors;
+    pthread_t	thread;
+    } worker_t;
+
+typedef struct _test {
+    char	*name;
+    int		(*op)(worker_t *w);
+    } test_t;
+
+static char	*dir;
+static int	files;		/* in /r and /w */
+static int	wsize = 4096;
+static char	*wdata;
+static double	duration = 5;
+static volatile int stop;
+
+
+
+static long long now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((long long) ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+static void pick(worker_t *w, const char *sub, char *path, int size)
+{
+	snprintf (path, size, "%s/%s/f%d", dir, sub, rand_r(&w->seed) % files);
+}
+
+
+static int op_stat(worker_t *w)
+{
+	char	path[FILENAME_MAX];
+	struct stat st;
+
+	pick(w, "r", path, sizeof(path));
+	return (stat(path, &st));
+}
+
+static int op_open(worker_t *w)
+{
+	int	fd, n;
+	char	path[FILENAME_MAX], buf[65536];
+
+	pick(w, "r", path, sizeof(path));
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return (-1);
+
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		;
+
+	close(fd);
+	return (n);
+}
+
+static int op_write(worker_t *w)
+{
+	int	fd, n;
+	char	path[FILENAME_MAX];
+
+	pick(w, "w", path, sizeof(path));
+	if ((fd = open(path, O_WRONLY)) < 0)
+		return (-1);
+
+	n = write(fd, wdata, wsize);
+	if (close(fd) != 0  ||  n != wsize)
+		return (-1);
+
+	return (0);
+}
+
+static int op_readdir(worker_t *w)
+{
+	char	path[FILENAME_MAX];
+	DIR	*d;
+
+	snprintf (path, sizeof(path), "%s/r", dir);
+	if ((d = opendir(path)) == NULL)
+		return (-1);
+
+	while (readdir(d) != NULL)
+		;
+
+	closedir(d);
+	return (0);
+}
+
+static int op_churn(worker_t *w)
+{
+	int	fd, rc = 0;
+	char	path[FILENAME_MAX];
+
+	snprintf (path, sizeof(path), "%s/u/t%d-%lu", dir, w->num, w->count);
+	if ((fd = open(path, O_WRONLY | O_CREAT, 0644)) < 0  ||
+	    close(fd) != 0  ||  unlink(path) != 0)
+		rc = -1;
+
+	if (mkdir(path, 0755) != 0  ||  rmdir(path) != 0)
+		rc = -1;
+
+	return (rc);
+}
+
+static test_t tests[] = {
+	{ "stat",	op_stat },
+	{ "open",	op_open },
+	{ "write",	op_write },
+	{ "readdir",	op_readdir },
+	{ "churn",	op_churn },
+	{ NULL,		NULL }
+	};
+
+
+static void *run(void *arg)
+{
+	long long start;
+	worker_t *w = arg;
+
+	while (stop == 0) {
+		start = now();
+		if (w->op(w) != 0)
+			w->errors++;
+
+		if (w->n >= w->size) {
+			w->size = 2 * w->size + 4096;
+			w->lat  = realloc(w->lat, w->size * sizeof(w->lat[0]));
+			}
+
+		w->lat[w->n++] = now() - start;
+		w->count++;
+		}
+
+	return (NULL);
+}
+
+static int cmp(const void *a, const void *b)
+{
+	unsigned long long x = *(unsigned long long *) a;
+	unsigned long long y = *(unsigned long long *) b;
+
+	return ((x < y)? -1: (x > y)? 1: 0);
+}
+
+static double percentile(unsigned long long *lat, unsigned long n, int permille)
+{
+	unsigned long k;
+
+	if (n == 0)
+		return (0);
+
+	k = (n * permille) / 1000;
+	return (lat[(k < n)? k: n - 1] / 1000.0);
+}
+
+static int bench(test_t *t, int threads)
+{
+	int	i;
+	unsigned long n = 0, errors = 0;
+	unsigned long long *lat;
+	long long start;
+	double	secs;
+	worker_t *w;
+
+	w = calloc(threads, sizeof(worker_t));
+	stop = 0;
+	start = now();
+	for (i = 0; i < threads; i++) {
+		w[i].num  = i;
+		w[i].op   = t->op;
+		w[i].seed = i + 1;
+		if (pthread_create(&w[i].thread, NULL, run, &w[i]) != 0) {
+			fprintf (stderr, "ux-bench: can't create thread\n");
+			exit (1);
+			}
+		}
+
+	usleep(duration * 1000000);
+	stop = 1;
+	for (i = 0; i < threads; i++) {
+		pthread_join(w[i].thread, NULL);
+		n += w[i].n;
+		errors += w[i].errors;
+		}
+
+	secs = (now() - start) / 1e9;
+
+	/*
+	 * The latencies of all threads are merged and sorted.
+	 */
+
+	lat = malloc((n + 1) * sizeof(lat[0]));
+	for (i = 0, n = 0; i < threads; i++) {
+		memcpy(&lat[n], w[i].lat, w[i].n * sizeof(lat[0]));
+		n += w[i].n;
+		free(w[i].lat);
+		}
+
+	qsort(lat, n, sizeof(lat[0]), cmp);
+	printf ("%-8s %7d %10lu %10.0f %9.1f %9.1f %9.1f %7lu\n",
+			t->name, threads, n, n / secs,
+			percentile(lat, n, 500), percentile(lat, n, 990),
+			percentile(lat, n, 999), errors);
+	fflush(stdout);
+
+	free(lat);
+	free(w);
+	return (errors != 0);
+}
+
+static int count(const char *sub)
+{
+	int	n = 0;
+	char	path[FILENAME_MAX];
+	DIR	*d;
+	struct dirent *e;
+
+	snprintf (path, sizeof(path), "%s/%s", dir, sub);
+	if ((d = opendir(path)) == NULL)
+		return (0);
+
+	while ((e = readdir(d)) != NULL) {
+		if (*e->d_name == 'f')
+			n++;
+		}
+
+	closedir(d);
+	return (n);
+}
+
+
+int main(int argc, char *argv[])
+{
+	int	c, i, k, rc = 0, threads = 4;
+	test_t	*t;
+
+	while ((c = getopt(argc, argv, "d:s:t:")) != -1) {
+		switch (c) {
+		case 'd':
+			duration = atof(optarg);
+			break;
+
+		case 's':
+			wsize = atoi(optarg);
+			break;
+
+		case 't':
+			if ((threads = atoi(optarg)) < 1)
+				threads = 1;
+			else if (threads > MAX_THREADS)
+				threads = MAX_THREADS;
+
+			break;
+
+		default:
+			goto usage;
+			}
+		}
+
+	if (optind >= argc) {
+usage:
+		fprintf (stderr, "usage: %s [-d seconds] [-s bytes] [-t threads] dir [test ...]\n", argv[0]);
+		exit (1);
+		}
+
+	dir = argv[optind++];
+	if ((files = count("r")) == 0  ||  count("w") < files) {
+		fprintf (stderr, "ux-bench: %s is not served by ux-mock\n", dir);
+		exit (1);
+		}
+
+	wdata = malloc(wsize);
+	memset(wdata, 'x', wsize);
+
+	printf ("%-8s %7s %10s %10s %9s %9s %9s %7s\n", "test", "threads",
+			"ops", "ops/s", "p50_us", "p99_us", "p999_us", "errors");
+	for (t = tests; t->name != NULL; t++) {
+		if (optind < argc) {
+			for (k = optind; k < argc; k++) {
+				if (strcmp(argv[k], t->name) == 0)
+					break;
+				}
+
+			if (k >= argc)
+				continue;
+			}
+
+		for (i = 1; i <= threads; i *= 2)
+			rc |= bench(t, i);
+
+		if ((i / 2) != threads)
+			rc |= bench(t, threads);
+		}
+
+	return (rc);
+}
@@ -0,0 +1,342 @@
+/*
+ *  ux-client.c - Reference controller for uxfs
+ *  Copyright (C) 2021  Wolfgang Zekoll, <wzk@quietsche-entchen.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+  /*
+   * Reference controller in C.  It serves the files given on the
+   * command line, data written to a file is returned by the next
+   * read:
+   *
+   *	mkdir -p x  &&  ./uxfs ./x -- ./ux-client notes data
+   *
+   * The client speaks all protocol versions uxfs offers: dot-
+   * stuffed lines (v1), length-prefixed blocks (v2) and memory
+   * files that are passed over the socket in UXFS_FDSOCK (v3).
+   * -2 keeps it at v2, -s defines the files with stream=r.
+   */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+
+
+#define	MEMFD_MIN	65536
+#define	LINE_MAX	1024
+
+
+typedef struct _file {
+    char	*path;
+    char	*data;
+    size_t	len;
+    struct _file *next;
+    } file_t;
+
+static file_t	*files;
+static int	proto = 1;
+static int	sock = -1;
+static int	stream;
+
+
+
+static file_t *getfile(const char *path)
+{
+	file_t	*f;
+
+	for (f = files; f != NULL; f = f->next) {
+		if (strcmp(f->path, path) == 0)
+			return (f);
+		}
+
+	return (NULL);
+}
+
+static int sendfd(int fd)
+{
+	char	c = 'F';
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	union {
+	    struct cmsghdr h;
+	    char	b[CMSG_SPACE(sizeof(int))];
+	    } cbuf;
+
+	iov.iov_base = &c;
+	iov.iov_len  = 1;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf.b;
+	msg.msg_controllen = sizeof(cbuf.b);
+
+	cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type  = SCM_RIGHTS;
+	cm->cmsg_len   = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+
+	return ((sendmsg(sock, &msg, 0) == 1)? 0: -1);
+}
+
+static int recvfd()
+{
+	int	fd = -1;
+	char	c;
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	union {
+	    struct cmsghdr h;
+	    char	b[CMSG_SPACE(sizeof(int))];
+	    } cbuf;
+
+	iov.iov_base = &c;
+	iov.iov_len  = 1;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf.b;
+	msg.msg_controllen = sizeof(cbuf.b);
+
+	if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1)
+		return (-1);
+
+	if ((cm = CMSG_FIRSTHDR(&msg)) != NULL  &&
+	    cm->cmsg_level == SOL_SOCKET  &&  cm->cmsg_type == SCM_RIGHTS)
+		memcpy(&fd, CMSG_DATA(cm), sizeof(int));
+
+	return (fd);
+}
+
+
+static char *readdata(size_t *len)
+{
+	int	fd;
+	char	*data, *p, *s = NULL, line[LINE_MAX];
+	size_t	n, size = 1, ssize = 0;
+	ssize_t	k;
+
+	/*
+	 * Returns the data block, NULL if the input is broken.
+	 */
+
+	*len = 0;
+	if (proto >= 2) {
+		if (fgets(line, sizeof(line), stdin) == NULL)
+			return (NULL);
+
+		n = strtoul(&line[1], NULL, 10);
+		data = malloc(n + 1);
+		if (line[0] == '@') {
+
+			/*
+			 * The data is in a memory file, a real
+			 * controller would work on the mapping.
+			 */
+
+			if ((fd = recvfd()) < 0)
+				return (NULL);
+
+			p = (n > 0)? mmap(NULL, n, PROT_READ, MAP_PRIVATE, fd, 0): NULL;
+			close(fd);
+			if (p == MAP_FAILED)
+				return (NULL);
+			else if (n > 0) {
+				memcpy(data, p, n);
+				munmap(p, n);
+				}
+			}
+		else if (line[0] != '='  ||  fread(data, 1, n, stdin) != n)
+			return (NULL);
+
+		*len = n;
+		return (data);
+		}
+
+	data = malloc(size);
+	while ((k = getline(&s, &ssize, stdin)) > 0) {
+		if (strcmp(s, ".\n") == 0)
+			break;
+
+		p = (*s == '.')? &s[1]: s;
+		n = k - (p - s);
+		if (*len + n + 1 > size) {
+			size = 2 * size + n + 1;
+			data = realloc(data, size);
+			}
+
+		memcpy(&data[*len], p, n);
+		*len += n;
+		}
+
+	free(s);
+	return (data);
+}
+
+static void writedata(const char *data, size_t len)
+{
+	int	fd;
+	size_t	n;
+	const char *p, *q, *end;
+
+	if (proto >= 3  &&  len >= MEMFD_MIN  &&
+	    (fd = memfd_create("ux-client", MFD_CLOEXEC)) >= 0) {
+		if (write(fd, data, len) == len  &&  sendfd(fd) == 0) {
+			printf ("@%zu\n", len);
+			close(fd);
+			return;
+			}
+
+		close(fd);
+		}
+
+	if (proto >= 2) {
+		printf ("=%zu\n", len);
+		fwrite(data, 1, len, stdout);
+		return;
+		}
+
+	for (p = data, end = data + len; p < end; p = q + 1) {
+		if ((q = memchr(p, '\n', end - p)) == NULL)
+			q = end;
+
+		n = q - p;
+		printf ("%s%.*s\n", (*p == '.')? ".": "", (int) n, p);
+		}
+
+	printf (".\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+	int	c, i, v2 = 0;
+	char	*p, *cmd, *path, *data, tag[20], line[LINE_MAX];
+	size_t	len;
+	file_t	*f;
+
+	while ((c = getopt(argc, argv, "2s")) != -1) {
+		switch (c) {
+		case '2':
+			v2 = 1;
+			break;
+
+		case 's':
+			stream = 1;
+			break;
+
+		default:
+			fprintf (stderr, "usage: %s [-2] [-s] file ...\n", argv[0]);
+			exit (1);
+			}
+		}
+
+	for (i = optind; i < argc; i++) {
+		f = calloc(1, sizeof(file_t));
+		if (asprintf(&f->path, "/%s", argv[i]) < 0)
+			exit (1);
+
+		f->next = files;
+		files = f;
+		}
+
+	if ((p = getenv("UXFS_FDSOCK")) != NULL  &&  v2 == 0)
+		sock = atoi(p);
+
+	while (fgets(line, sizeof(line), stdin) != NULL) {
+		line[strcspn(line, "\n")] = '\0';
+		cmd  = strtok(line, " ");
+		path = strtok(NULL, " ");
+		if (cmd == NULL)
+			continue;
+
+		*tag = '\0';
+		if ((p = strchr(cmd, '#')) != NULL) {
+			snprintf (tag, sizeof(tag), "%s", p);
+			*p = '\0';
+			}
+
+		if (strcmp(cmd, "INIT") == 0) {
+			printf ("+OK%s", tag);
+			if (sock >= 0)
+				printf ("; PROTO 3");
+			else if (getenv("UXFS_PROTO") != NULL)
+				printf ("; PROTO 2");
+
+			printf ("; DIR\n");
+			for (f = files; f != NULL; f = f->next)
+				printf ("%s rw%s\n", f->path, (stream != 0)? " stream=r": "");
+
+			printf (".\n");
+			fflush(stdout);
+			proto = (sock >= 0)? 3: (getenv("UXFS_PROTO") != NULL)? 2: 1;
+			}
+		else if (strcmp(cmd, "PROTO") == 0) {
+			proto = (path != NULL  &&  atoi(path) >= 3  &&  sock >= 0)? 3: 2;
+			printf ("+OK%s; PROTO %d\n", tag, proto);
+			fflush(stdout);
+			}
+		else if (strcmp(cmd, "READ") == 0) {
+			if (path == NULL  ||  (f = getfile(path)) == NULL)
+				printf ("-ERR%s\n", tag);
+			else {
+				printf ("+OK%s\n", tag);
+				writedata((f->data != NULL)? f->data: "", f->len);
+				}
+
+			fflush(stdout);
+			}
+		else if (strcmp(cmd, "WRITE") == 0  ||
+			 strcmp(cmd, "APPEND") == 0  ||
+			 strcmp(cmd, "FILEOP") == 0) {
+			if ((data = readdata(&len)) == NULL)
+				break;
+
+			f = (path != NULL)? getfile(path): NULL;
+			if (f != NULL  &&  strcmp(cmd, "WRITE") == 0) {
+				free(f->data);
+				f->data = data;
+				f->len  = len;
+				}
+			else if (f != NULL  &&  strcmp(cmd, "APPEND") == 0) {
+				f->data = realloc(f->data, f->len + len + 1);
+				memcpy(&f->data[f->len], data, len);
+				f->len += len;
+				free(data);
+				}
+			else
+				free(data);
+
+			printf ("+OK%s\n", tag);
+			fflush(stdout);
+			}
+		else {
+			printf ("%s%s\n", (strcmp(cmd, "CLOSE") == 0)? "+OK": "-ERR", tag);
+			fflush(stdout);
+			}
+		}
+
+	return (0);
+}
@@ -0,0 +1,257 @@
+/*
+ *  ux-mock.c - Mock controller for benchmarking uxfs
+ *  Copyright (C) 2021  Wolfgang Zekoll, <wzk@quietsche-entchen.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+  /*
+   * A controller that does nothing but answer, fast enough that
+   * benchmarks measure uxfs and not the controller:
+   *
+   *	./uxfs -t ./x -- ./ux-mock -n 1000 -s 4096 -l 200
+   *
+   * It defines the files /r/f0 ... (readable), /w/f0 ...
+   * (writeable), the directory /u where processes can create
+   * files, and /shutdown.  READ replies carry `-s` bytes of
+   * data and are delayed by `-l` microseconds.  In tagged mode
+   * delayed replies are sent from a thread of their own, so
+   * they overlap like those of a real controller.
+   */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+
+#define	LINE_MAX	1024
+
+
+typedef struct _reply {
+    char	*text;
+    int		len;
+    } reply_t;
+
+static int	proto = 1;
+static int	tagged;
+static int	latency;		/* us */
+static char	*payload;		/* READ reply data, as sent */
+static int	payload_len;
+static pthread_mutex_t out = PTHREAD_MUTEX_INITIALIZER;
+
+
+
+static void send_reply(const char *status, const char *tag, int data)
+{
+	pthread_mutex_lock(&out);
+	printf ("%s%s\n", status, tag);
+	if (data != 0)
+		fwrite(payload, 1, payload_len, stdout);
+
+	fflush(stdout);
+	pthread_mutex_unlock(&out);
+}
+
+static void *delayed(void *arg)
+{
+	reply_t	*r = arg;
+
+	usleep(latency);
+	pthread_mutex_lock(&out);
+	fwrite(r->text, 1, r->len, stdout);
+	fflush(stdout);
+	pthread_mutex_unlock(&out);
+
+	free(r->text);
+	free(r);
+	return (NULL);
+}
+
+static void reply(const char *status, const char *tag, int data)
+{
+	pthread_t th;
+	reply_t	*r;
+
+	if (latency <= 0) {
+		send_reply(status, tag, data);
+		return;
+		}
+	else if (tagged == 0) {
+		usleep(latency);
+		send_reply(status, tag, data);
+		return;
+		}
+
+	r = malloc(sizeof(reply_t));
+	r->len  = strlen(status) + strlen(tag) + 1;
+	r->text = malloc(r->len + ((data != 0)? payload_len: 0));
+	sprintf (r->text, "%s%s\n", status, tag);
+	if (data != 0) {
+		memcpy(&r->text[r->len], payload, payload_len);
+		r->len += payload_len;
+		}
+
+	if (pthread_create(&th, NULL, delayed, r) != 0)
+		delayed(r);
+	else
+		pthread_detach(th);
+}
+
+static int skipdata()
+{
+	int	n;
+	char	line[LINE_MAX];
+
+	/*
+	 * Data sent with WRITE, APPEND and FILEOP is read and
+	 * dropped.
+	 */
+
+	if (proto >= 2) {
+		if (fgets(line, sizeof(line), stdin) == NULL  ||  *line != '=')
+			return (-1);
+
+		for (n = atoi(&line[1]); n > 0; n--) {
+			if (getchar() == EOF)
+				return (-1);
+			}
+
+		return (0);
+		}
+
+	while (fgets(line, sizeof(line), stdin) != NULL) {
+		if (strcmp(line, ".\n") == 0)
+			return (0);
+		}
+
+	return (-1);
+}
+
+static void mkpayload(int size)
+{
+	int	i, k;
+	char	*p;
+
+	/*
+	 * Lines of 64 bytes.  Protocol v1 needs the terminating
+	 * dot, v2 the length.
+	 */
+
+	payload = malloc(size + 40);
+	p = payload;
+	if (proto >= 2)
+		p += sprintf (p, "=%d\n", size);
+
+	for (i = k = 0; i < size; i++)
+		*p++ = (++k % 64 == 0  ||  i == size - 1)? '\n': 'x';
+
+	if (proto < 2)
+		p += sprintf (p, ".\n");
+
+	payload_len = p - payload;
+}
+
+
+int main(int argc, char *argv[])
+{
+	int	c, i, count = 1000, size = 4096, v1 = 0;
+	char	*p, *cmd, *path, tag[40], line[LINE_MAX];
+
+	while ((c = getopt(argc, argv, "1l:n:s:")) != -1) {
+		switch (c) {
+		case '1':
+			v1 = 1;
+			break;
+
+		case 'l':
+			latency = atoi(optarg);
+			break;
+
+		case 'n':
+			count = atoi(optarg);
+			break;
+
+		case 's':
+			size = atoi(optarg);
+			break;
+
+		default:
+			fprintf (stderr, "usage: %s [-1] [-l usec] [-n files] [-s bytes]\n", argv[0]);
+			exit (1);
+			}
+		}
+
+	tagged = (getenv("UXFS_TAGGED") != NULL);
+	proto  = (v1 == 0  &&  getenv("UXFS_PROTO") != NULL)? 2: 1;
+	mkpayload(size);
+
+	while (fgets(line, sizeof(line), stdin) != NULL) {
+		line[strcspn(line, "\n")] = '\0';
+		cmd  = strtok(line, " ");
+		path = strtok(NULL, " ");
+		if (cmd == NULL)
+			continue;
+
+		*tag = '\0';
+		if ((p = strchr(cmd, '#')) != NULL) {
+			snprintf (tag, 20, "%s", p);
+			*p = '\0';
+			}
+
+		if (strcmp(cmd, "INIT") == 0) {
+
+			/*
+			 * The file definitions are not delayed.
+			 */
+
+			pthread_mutex_lock(&out);
+			printf ("+OK%s%s; DIR\n", tag, (proto >= 2)? "; PROTO 2": "");
+			printf ("/ r\n/u/ rw\n/shutdown w\n");
+			for (i = 0; i < count; i++)
+				printf ("/r/f%d r\n/w/f%d w\n", i, i);
+
+			printf (".\n");
+			fflush(stdout);
+			pthread_mutex_unlock(&out);
+			}
+		else if (strcmp(cmd, "PROTO") == 0) {
+			pthread_mutex_lock(&out);
+			printf ("+OK%s; PROTO %d\n", tag, proto);
+			fflush(stdout);
+			pthread_mutex_unlock(&out);
+			}
+		else if (strcmp(cmd, "READ") == 0)
+			reply("+OK", tag, 1);
+		else if (strcmp(cmd, "WRITE") == 0  ||
+			 strcmp(cmd, "APPEND") == 0  ||
+			 strcmp(cmd, "FILEOP") == 0) {
+			if (skipdata() != 0)
+				break;
+
+			if (path != NULL  &&  strcmp(path, "/shutdown") == 0)
+				send_reply("+OK", strcat(tag, "; QUIT"), 0);
+			else
+				reply("+OK", tag, 0);
+			}
+		else
+			reply((strcmp(cmd, "CLOSE") == 0)? "+OK": "-ERR", tag, 0);
+		}
+
+	return (0);
+}
@@ -0,0 +1,852 @@
+/*
+ *  ux-replay.c - Replay uxfs recordings
+ *  Copyright (C) 2021  Wolfgang Zekoll, <wzk@quietsche-entchen.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+  /*
+   * Replays a session that uxfs recorded with -R.  As controller
+   * ux-replay defines the recorded files and answers requests
+   * with the replies the real controller gave:
+   *
+   *	./uxfs -t ./x -- ./ux-replay -c session.rec
+   *
+   * Given a directory it runs the recorded operations against
+   * the mount with one thread for each recording thread:
+   *
+   *	./ux-replay session.rec ./x
+   *
+   * Both keep the recorded timing, -x changes the speed and -f
+   * replays as fast as possible.  Operations still wait for the
+   * open of their file.
+   */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+
+#define	LINE_MAX	1024
+#define	HASH_SIZE	4096
+
+  /*
+   * Copied from uxfs.c.
+   */
+
+#define	S_GETATTR	0
+#define	S_OPEN		1
+#define	S_READ		2
+#define	S_WRITE		3
+#define	S_RELEASE	4
+#define	S_READDIR	5
+#define	S_MKDIR		7
+#define	S_UNLINK	8
+#define	S_RMDIR		9
+#define	S_RENAME	10
+#define	S_CREATE	11
+#define	S_MAX		12
+
+#define	REC_MAGIC	"UXFSREC1"
+#define	REC_OP		1
+#define	REC_REQUEST	2
+#define	REC_REPLY	3
+#define	REC_FILE	4
+
+typedef struct _record {
+    unsigned int length;	/* of the record and its payload */
+    unsigned int data;
+    unsigned short type;
+    unsigned short op;		/* S_GETATTR ... */
+    int		thread;		/* REC_OP: thread, else channel */
+    int		tag;		/* request and reply */
+    int		rc;		/* result, reply status */
+    int		flags;		/* open flags, reply TTL */
+    int		pad;
+    long long	time;		/* ns since recording started */
+    long long	duration;	/* ns */
+    unsigned long long fh;	/* file handle */
+    long long	offset;
+    long long	size;		/* read/write size, request data */
+    } record_t;
+
+
+typedef struct _entry {
+    record_t	r;		/* the header, aligned */
+    char	*s1, *s2;	/* path or command, target or parameter */
+    char	*data;
+
+    int		open;		/* REC_OP: index of the file's open */
+    struct _entry *request;	/* REC_REPLY: its request */
+    } entry_t;
+
+typedef struct _reply {
+    char	*key;		/* "command parameter" */
+    entry_t	**e;
+    int		count, size, next;
+    struct _reply *hnext;
+    } reply_t;
+
+typedef struct _map {
+    unsigned long long *key;
+    int		*value;		/* entry index, -1 if unused */
+    int		size, count;
+    } map_t;
+
+typedef struct _worker {
+    int		thread;
+    entry_t	**op;
+    int		count, size;
+
+    long long	*lat[S_MAX];	/* ns */
+    int		n[S_MAX], nsize[S_MAX];
+    unsigned long errors, mismatches;
+    pthread_t	th;
+    } worker_t;
+
+static entry_t	*entry;
+static int	entries;
+static double	speed = 1;
+static int	fast;
+static long long t0;
+
+static int	proto = 1;
+static int	tagged;
+static reply_t	*hash[HASH_SIZE];
+static pthread_mutex_t out = PTHREAD_MUTEX_INITIALIZER;
+
+static char	*dir;
+static int	*fds;		/* by the index of the open */
+static pthread_mutex_t fdlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fdcond = PTHREAD_COND_INITIALIZER;
+
+static const char *opname[S_MAX] = {
+	"getattr", "open", "read", "write", "release", "readdir",
+	"", "mkdir", "unlink", "rmdir", "rename", "create"
+	};
+
+
+
+  /*
+   * map_t finds the entry index of a file handle or request tag
+   * so that linking the entries stays linear in the size of the
+   * recording.
+   */
+
+static int *map_slot(map_t *m, unsigned long long key)
+{
+	unsigned int i;
+
+	i = (unsigned int) ((key * 0x9E3779B97F4A7C15ULL) >> 32) & (m->size - 1);
+	while (m->value[i] >= 0  &&  m->key[i] != key)
+		i = (i + 1) & (m->size - 1);
+
+	return (&m->value[i]);
+}
+
+static int map_get(map_t *m, unsigned long long key)
+{
+	return ((m->size == 0)? -1: *map_slot(m, key));
+}
+
+static void map_put(map_t *m, unsigned long long key, int value)
+{
+	int	i, *v;
+	map_t	old = *m;
+
+	if (2 * (m->count + 1) > m->size) {
+		m->size  = (old.size == 0)? 1024: 2 * old.size;
+		m->key   = malloc(m->size * sizeof(unsigned long long));
+		m->value = malloc(m->size * sizeof(int));
+		memset(m->value, 0xff, m->size * sizeof(int));
+		for (i = 0; i < old.size; i++) {
+			if (old.value[i] >= 0) {
+				v = map_slot(m, old.key[i]);
+				m->key[v - m->value] = old.key[i];
+				*v = old.value[i];
+				}
+			}
+
+		free(old.key);
+		free(old.value);
+		}
+
+	if (*(v = map_slot(m, key)) < 0)
+		m->count++;
+
+	m->key[v - m->value] = key;
+	*v = value;
+}
+
+static void map_free(map_t *m)
+{
+	free(m->key);
+	free(m->value);
+	memset(m, 0, sizeof(map_t));
+}
+
+
+static long long now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((long long) ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+static void wait_until(long long t)
+{
+	long long d;
+
+	/*
+	 * `t` is the time in the recording.
+	 */
+
+	if (fast != 0)
+		return;
+
+	if ((d = t0 + (long long) (t / speed) - now()) > 0)
+		usleep(d / 1000);
+}
+
+static void load(const char *filename)
+{
+	int	size = 0;
+	char	*buf, *p, *end;
+	long	len;
+	FILE	*fp;
+	entry_t	*e;
+
+	if ((fp = fopen(filename, "r")) == NULL) {
+		fprintf (stderr, "ux-replay: can't open %s: %s\n", filename, strerror(errno));
+		exit (1);
+		}
+
+	fseek(fp, 0, SEEK_END);
+	len = ftell(fp);
+	rewind(fp);
+	buf = malloc(len + 1);
+	if (fread(buf, 1, len, fp) != len  ||
+	    len < strlen(REC_MAGIC)  ||
+	    memcmp(buf, REC_MAGIC, strlen(REC_MAGIC)) != 0) {
+		fprintf (stderr, "ux-replay: %s is not a uxfs recording\n", filename);
+		exit (1);
+		}
+
+	fclose(fp);
+
+	/*
+	 * Records follow their strings unaligned, the entries keep
+	 * a copy of the header and point into the buffer for the
+	 * strings and data.  A record that was cut off ends the
+	 * recording.
+	 */
+
+	end = buf + len;
+	for (p = buf + strlen(REC_MAGIC); p + sizeof(record_t) <= end; p += len) {
+		record_t r;
+
+		memcpy(&r, p, sizeof(record_t));
+		if ((len = r.length) < sizeof(record_t)  ||  p + len > end)
+			break;
+
+		if (entries >= size) {
+			size = 2 * size + 1024;
+			entry = realloc(entry, size * sizeof(entry_t));
+			}
+
+		e = &entry[entries++];
+		memset(e, 0, sizeof(entry_t));
+		e->r = r;
+		e->data = p + len - r.data;
+		if (e->data > p + sizeof(record_t)) {
+			e->s1 = p + sizeof(record_t);
+			if (e->s1 + strlen(e->s1) + 1 < e->data)
+				e->s2 = e->s1 + strlen(e->s1) + 1;
+			}
+		}
+}
+
+
+/*
+ * Stand-in controller
+ */
+
+static unsigned int keyhash(const char *s)
+{
+	unsigned int h;
+
+	for (h = 5381; *s != '\0'; s++)
+		h = h * 33 + (unsigned char) *s;
+
+	return (h % HASH_SIZE);
+}
+
+static reply_t *getreply(const char *key, int add)
+{
+	unsigned int h = keyhash(key);
+	reply_t	*x;
+
+	for (x = hash[h]; x != NULL; x = x->hnext) {
+		if (strcmp(x->key, key) == 0)
+			return (x);
+		}
+
+	if (add == 0)
+		return (NULL);
+
+	x = calloc(1, sizeof(reply_t));
+	x->key = strdup(key);
+	x->hnext = hash[h];
+	hash[h] = x;
+	return (x);
+}
+
+static void index_replies()
+{
+	int	i, k;
+	char	key[LINE_MAX];
+	entry_t	*e, *q;
+	reply_t	*x;
+	map_t	requests;
+
+	/*
+	 * Replies are found by the channel and tag of their
+	 * request and filed by its command and parameter.  The
+	 * same request gets the recorded replies in turn.
+	 */
+
+	memset(&requests, 0, sizeof(map_t));
+	for (i = 0; i < entries; i++) {
+		e = &entry[i];
+		if (e->r.type == REC_REQUEST) {
+			map_put(&requests, ((unsigned long long) e->r.thread << 32) |
+					(unsigned int) e->r.tag, i);
+			continue;
+			}
+		else if (e->r.type != REC_REPLY)
+			continue;
+
+		k = map_get(&requests, ((unsigned long long) e->r.thread << 32) |
+				(unsigned int) e->r.tag);
+		if (k < 0  ||  (q = &entry[k])->s1 == NULL)
+			continue;
+
+		e->request = q;
+		snprintf (key, sizeof(key), "%s %s", q->s1, (q->s2 != NULL)? q->s2: "");
+		x = getreply(key, 1);
+		if (x->count >= x->size) {
+			x->size = 2 * x->size + 16;
+			x->e = realloc(x->e, x->size * sizeof(entry_t *));
+			}
+
+		x->e[x->count++] = e;
+		}
+
+	map_free(&requests);
+}
+
+static void putdata(FILE *fp, const char *data, int len)
+{
+	const char *p, *q, *end;
+
+	if (proto >= 2) {
+		fprintf (fp, "=%d\n", len);
+		fwrite(data, 1, len, fp);
+		return;
+		}
+
+	for (p = data, end = data + len; p < end; p = q + 1) {
+		if ((q = memchr(p, '\n', end - p)) == NULL)
+			q = end;
+
+		fprintf (fp, "%s%.*s\n", (*p == '.')? ".": "", (int) (q - p), p);
+		}
+
+	fprintf (fp, ".\n");
+}
+
+typedef struct _answer {
+    char	tag[20];
+    int		data;		/* READ: data follows +OK */
+    entry_t	*e;
+    } answer_t;
+
+static void *answer(void *arg)
+{
+	answer_t *a = arg;
+	entry_t	*e = a->e;
+	char	*buf;
+	size_t	len;
+	FILE	*fp;
+
+	/*
+	 * The reply is assembled first and waits for the time
+	 * the controller took.
+	 */
+
+	fp = open_memstream(&buf, &len);
+	if (e == NULL) {
+		fprintf (fp, "+OK%s\n", a->tag);
+		if (a->data != 0)
+			putdata(fp, "", 0);
+		}
+	else if (e->r.rc != 0)
+		fprintf (fp, "-ERR%s\n", a->tag);
+	else {
+		fprintf (fp, "+OK%s", a->tag);
+		if (e->r.flags >= 0)
+			fprintf (fp, "; TTL %d", e->r.flags);
+
+		fprintf (fp, "\n");
+		if (a->data != 0)
+			putdata(fp, e->data, e->r.data);
+		}
+
+	fclose(fp);
+	if (e != NULL  &&  fast == 0)
+		usleep((e->r.time - e->request->r.time) / speed / 1000);
+
+	pthread_mutex_lock(&out);
+	fwrite(buf, 1, len, stdout);
+	fflush(stdout);
+	pthread_mutex_unlock(&out);
+
+	free(buf);
+	free(a);
+	return (NULL);
+}
+
+static int skipdata()
+{
+	int	n;
+	char	line[LINE_MAX];
+
+	if (proto >= 2) {
+		if (fgets(line, sizeof(line), stdin) == NULL  ||  *line != '=')
+			return (-1);
+
+		for (n = atoi(&line[1]); n > 0; n--) {
+			if (getchar() == EOF)
+				return (-1);
+			}
+
+		return (0);
+		}
+
+	while (fgets(line, sizeof(line), stdin) != NULL) {
+		if (strcmp(line, ".\n") == 0)
+			return (0);
+		}
+
+	return (-1);
+}
+
+static int controller()
+{
+	int	i;
+	char	*p, *cmd, *par, key[2 * LINE_MAX], line[LINE_MAX];
+	pthread_t th;
+	answer_t *a;
+	reply_t	*x;
+
+	tagged = (getenv("UXFS_TAGGED") != NULL);
+	proto  = (getenv("UXFS_PROTO") != NULL)? 2: 1;
+	index_replies();
+
+	while (fgets(line, sizeof(line), stdin) != NULL) {
+		line[strcspn(line, "\n")] = '\0';
+		if ((par = strchr(line, ' ')) != NULL)
+			*par++ = '\0';
+
+		cmd = line;
+		a = calloc(1, sizeof(answer_t));
+		if ((p = strchr(cmd, '#')) != NULL) {
+			snprintf (a->tag, sizeof(a->tag), "%s", p);
+			*p = '\0';
+			}
+
+		if (strcmp(cmd, "INIT") == 0) {
+			pthread_mutex_lock(&out);
+			printf ("+OK%s%s; DIR\n", a->tag, (proto >= 2)? "; PROTO 2": "");
+			for (i = 0; i < entries; i++) {
+				if (entry[i].r.type == REC_FILE  &&  entry[i].s1 != NULL)
+					printf ("%s\n", entry[i].s1);
+				}
+
+			printf (".\n");
+			fflush(stdout);
+			pthread_mutex_unlock(&out);
+			free(a);
+			continue;
+			}
+		else if (strcmp(cmd, "PROTO") == 0) {
+			pthread_mutex_lock(&out);
+			printf ("+OK%s; PROTO %d\n", a->tag, proto);
+			fflush(stdout);
+			pthread_mutex_unlock(&out);
+			free(a);
+			continue;
+			}
+		else if (strcmp(cmd, "WRITE") == 0  ||
+			 strcmp(cmd, "APPEND") == 0  ||
+			 strcmp(cmd, "FILEOP") == 0) {
+			if (skipdata() != 0)
+				break;
+			}
+
+		snprintf (key, sizeof(key), "%s %s", cmd, (par != NULL)? par: "");
+		if ((x = getreply(key, 0)) != NULL) {
+			a->e = x->e[x->next];
+			x->next = (x->next + 1) % x->count;
+			}
+
+		a->data = (strcmp(cmd, "READ") == 0);
+		if (tagged == 0  ||  fast != 0  ||
+		    pthread_create(&th, NULL, answer, a) != 0)
+			answer(a);
+		else
+			pthread_detach(th);
+		}
+
+	return (0);
+}
+
+
+/*
+ * Replaying operations
+ */
+
+static void timed(worker_t *w, int op, long long start)
+{
+	if (w->n[op] >= w->nsize[op]) {
+		w->nsize[op] = 2 * w->nsize[op] + 1024;
+		w->lat[op] = realloc(w->lat[op], w->nsize[op] * sizeof(long long));
+		}
+
+	w->lat[op][w->n[op]++] = now() - start;
+}
+
+static int getfd(entry_t *e)
+{
+	int	fd;
+
+	if (e->open < 0)
+		return (-1);
+
+	pthread_mutex_lock(&fdlock);
+	while ((fd = fds[e->open]) == -2)
+		pthread_cond_wait(&fdcond, &fdlock);
+
+	pthread_mutex_unlock(&fdlock);
+	return (fd);
+}
+
+static void setfd(entry_t *e, int fd)
+{
+	pthread_mutex_lock(&fdlock);
+	fds[e - entry] = fd;
+	pthread_cond_broadcast(&fdcond);
+	pthread_mutex_unlock(&fdlock);
+}
+
+static void *run(void *arg)
+{
+	int	i, fd = -1, rc;
+	long long start;
+	size_t	size = 0;
+	char	*buf = NULL, path[FILENAME_MAX], to[FILENAME_MAX];
+	entry_t	*e;
+	record_t *r;
+	worker_t *w = arg;
+	struct stat st;
+	DIR	*d;
+
+	for (i = 0; i < w->count; i++) {
+		e = w->op[i];
+		r = &e->r;
+		snprintf (path, sizeof(path), "%s%s", dir, e->s1);
+		if (e->s2 != NULL)
+			snprintf (to, sizeof(to), "%s%s", dir, e->s2);
+
+		if (r->size > size) {
+			size = r->size;
+			buf = realloc(buf, size);
+			memset(buf, 'x', size);
+			}
+
+		wait_until(r->time);
+		if (r->op == S_READ  ||  r->op == S_WRITE  ||  r->op == S_RELEASE)
+			fd = getfd(e);
+
+		start = now();
+		switch (r->op) {
+		case S_GETATTR:
+			rc = lstat(path, &st);
+			break;
+
+		case S_OPEN:
+		case S_CREATE:
+			fd = open(path, (r->flags & O_ACCMODE) |
+					((r->op == S_CREATE)? O_CREAT: 0), 0644);
+			setfd(e, fd);
+			rc = (fd < 0)? -1: 0;
+			break;
+
+		case S_READ:
+			rc = pread(fd, buf, r->size, r->offset);
+			break;
+
+		case S_WRITE:
+			rc = pwrite(fd, buf, r->size, r->offset);
+			break;
+
+		case S_RELEASE:
+			rc = (fd >= 0)? close(fd): -1;
+			break;
+
+		case S_READDIR:
+			if ((d = opendir(path)) == NULL)
+				rc = -1;
+			else {
+				while (readdir(d) != NULL)
+					;
+
+				rc = closedir(d);
+				}
+
+			break;
+
+		case S_MKDIR:
+			rc = mkdir(path, 0755);
+			break;
+
+		case S_UNLINK:
+			rc = unlink(path);
+			break;
+
+		case S_RMDIR:
+			rc = rmdir(path);
+			break;
+
+		case S_RENAME:
+			rc = rename(path, to);
+			break;
+
+		default:
+			continue;
+			}
+
+		timed(w, r->op, start);
+		if (rc < 0)
+			w->errors++;
+
+		if ((rc < 0) != (r->rc < 0))
+			w->mismatches++;
+		}
+
+	free(buf);
+	return (NULL);
+}
+
+static int cmp(const void *a, const void *b)
+{
+	long long x = *(long long *) a, y = *(long long *) b;
+
+	return ((x < y)? -1: (x > y)? 1: 0);
+}
+
+static double percentile(long long *lat, int n, int permille)
+{
+	int	k;
+
+	if (n == 0)
+		return (0);
+
+	k = ((long long) n * permille) / 1000;
+	return (lat[(k < n)? k: n - 1] / 1000.0);
+}
+
+static int replay()
+{
+	int	i, k, n, op, threads = 0;
+	long long *lat, *rlat;
+	unsigned long errors = 0, mismatches = 0;
+	double	secs;
+	entry_t	*e;
+	worker_t *w = NULL, *x;
+	map_t	opens;
+
+	/*
+	 * Operations on a file handle belong to the latest open
+	 * that returned it.
+	 */
+
+	fds = malloc(entries * sizeof(int));
+	memset(&opens, 0, sizeof(map_t));
+	for (i = 0; i < entries; i++) {
+		e = &entry[i];
+		fds[i] = -2;
+		e->open = -1;
+		if (e->r.type != REC_OP  ||  e->s1 == NULL  ||  e->r.op >= S_MAX)
+			continue;
+		else if (e->r.fh == 0)
+			;
+		else if (e->r.op == S_OPEN  ||  e->r.op == S_CREATE)
+			map_put(&opens, e->r.fh, i);
+		else if (e->r.op == S_READ  ||  e->r.op == S_WRITE  ||
+			 e->r.op == S_RELEASE)
+			e->open = map_get(&opens, e->r.fh);
+
+		for (k = 0; k < threads; k++) {
+			if (w[k].thread == e->r.thread)
+				break;
+			}
+
+		if (k == threads) {
+			w = realloc(w, ++threads * sizeof(worker_t));
+			memset(&w[k], 0, sizeof(worker_t));
+			w[k].thread = e->r.thread;
+			}
+
+		x = &w[k];
+		if (x->count >= x->size) {
+			x->size = 2 * x->size + 256;
+			x->op = realloc(x->op, x->size * sizeof(entry_t *));
+			}
+
+		x->op[x->count++] = e;
+		}
+
+	map_free(&opens);
+
+	/*
+	 * Opens that fail in the recording never set their
+	 * descriptor.
+	 */
+
+	for (i = 0; i < entries; i++) {
+		if (entry[i].r.type == REC_OP  &&  entry[i].r.rc < 0  &&
+		    (entry[i].r.op == S_OPEN  ||  entry[i].r.op == S_CREATE))
+			fds[i] = -1;
+		}
+
+	t0 = now();
+	for (k = 0; k < threads; k++)
+		pthread_create(&w[k].th, NULL, run, &w[k]);
+
+	for (k = 0; k < threads; k++)
+		pthread_join(w[k].th, NULL);
+
+	secs = (now() - t0) / 1e9;
+
+	/*
+	 * The recorded latencies are shown next to those of the
+	 * replay.
+	 */
+
+	printf ("%-8s %8s %10s %9s %9s %9s %12s\n", "op", "count", "ops/s",
+			"p50_us", "p99_us", "p999_us", "rec_p50_us");
+	for (op = 0; op < S_MAX; op++) {
+		for (k = n = 0; k < threads; k++)
+			n += w[k].n[op];
+
+		if (n == 0)
+			continue;
+
+		lat  = malloc(n * sizeof(long long));
+		rlat = malloc(entries * sizeof(long long));
+		for (k = n = 0; k < threads; k++) {
+			if (w[k].n[op] > 0)
+				memcpy(&lat[n], w[k].lat[op], w[k].n[op] * sizeof(long long));
+
+			n += w[k].n[op];
+			}
+
+		for (i = k = 0; i < entries; i++) {
+			if (entry[i].r.type == REC_OP  &&  entry[i].r.op == op)
+				rlat[k++] = entry[i].r.duration;
+			}
+
+		qsort(lat, n, sizeof(long long), cmp);
+		qsort(rlat, k, sizeof(long long), cmp);
+		printf ("%-8s %8d %10.0f %9.1f %9.1f %9.1f %12.1f\n",
+				opname[op], n, n / secs,
+				percentile(lat, n, 500), percentile(lat, n, 990),
+				percentile(lat, n, 999), percentile(rlat, k, 500));
+		free(lat);
+		free(rlat);
+		}
+
+	for (k = 0; k < threads; k++) {
+		errors += w[k].errors;
+		mismatches += w[k].mismatches;
+		}
+
+	printf ("%d threads, %.2f s, %lu errors, %lu differ from the recording\n",
+			threads, secs, errors, mismatches);
+	return (mismatches != 0);
+}
+
+
+int main(int argc, char *argv[])
+{
+	int	c, serve = 0;
+
+	while ((c = getopt(argc, argv, "cfx:")) != -1) {
+		switch (c) {
+		case 'c':
+			serve = 1;
+			break;
+
+		case 'f':
+			fast = 1;
+			break;
+
+		case 'x':
+			if ((speed = atof(optarg)) <= 0)
+				speed = 1;
+
+			break;
+
+		default:
+			goto usage;
+			}
+		}
+
+	if (optind >= argc  ||  (serve == 0  &&  optind + 1 >= argc)) {
+usage:
+		fprintf (stderr, "usage: %s [-f] [-x speed] -c recording\n", argv[0]);
+		fprintf (stderr, "       %s [-f] [-x speed] recording dir\n", argv[0]);
+		exit (1);
+		}
+
+	load(argv[optind]);
+	if (serve != 0)
+		return (controller());
+
+	dir = argv[optind + 1];
+	return (replay());
+}
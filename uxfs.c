@@ -35,17 +35,24 @@
 #include <sys/stat.h>
 
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
 #include <dirent.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <time.h>
 
 #include <stdarg.h>
 #include <grp.h>
 #include <pwd.h>
 #include <assert.h>
 #include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
 
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 
 
 #define	T_START		1
@@ -53,14 +60,27 @@
 #define T_BOTH		(T_START | T_END)
 
 #define	MAX_ARGS	32
+#define	MAX_JOBS	16
+#define	MAX_IOV		1024
+#define	MAX_FILESIZE	0x7fffffff
 #define	MIN_FREE	4
 #define	LINE_MAX	1024
+#define	T_NEVER		0x7fffffffffffffffLL
+#define	PIPE_SIZE	(1024 * 1024)
+#define	STREAM_CHUNK	65536
+#define	CHUNK_SIZE	65536
+#define	MEMFD_MIN	65536
+#define	READAHEAD_MAX	32
 
 #define	M_READ		1
 #define	M_WRITE		2
 #define	M_DIR		4
 #define	M_USER		8
 #define	M_STATIC	16
+#define	M_IDEMPOTENT	32
+#define	M_STREAM_READ	64
+#define	M_STREAM_WRITE	128
+#define	M_STATS		256
 
 
 #define	R_NONE		0
@@ -68,10 +88,36 @@
 #define	R_MULTI		2
 #define	C_STATUS	3
 #define	C_TEMP_DATA	8
+#define	C_STREAM	16
+#define	C_PREFETCH	32
 
 #define	P_VERBOSE	8
 #define	P_EXTRA		9
 
+  /*
+   * LOG() compares the message level to -v before the message
+   * is formatted, so that disabled messages cost nothing on the
+   * hot paths.
+   */
+
+#define	LOG(level, ...)	do { \
+		if (uxfs.verbose > (level) - P_VERBOSE) \
+			printerror(level, "", __VA_ARGS__); \
+		} while (0)
+
+
+  /*
+   * File data that is written, and the content of M_USER files,
+   * is kept in fixed-size chunks instead of one buffer: a write
+   * touches only the chunks it covers and the chunks are shared
+   * between a file and its readers until one of them is written.
+   * Chunks that were never written read as zeros.
+   */
+
+typedef struct _chunk {
+    int		refs;
+    char	data[CHUNK_SIZE];
+    } chunk_t;
 
 typedef struct _buffer {
     int		mode;
@@ -79,29 +125,282 @@ typedef struct _buffer {
     int		here, end;
     int		size;
     char	*buffer;
+
+    chunk_t	**chunk;	/* the data if buffer is NULL */
+    int		chunks;		/* size of chunk[] */
+
+    int		ttl;		/* TTL from the controller's reply */
     } buf_t;
 
 
+  /*
+   * Path components are stored only once, all files with the
+   * same name share it.
+   */
+
+typedef struct _name {
+    struct _name *next;		/* next name in the same hash bucket */
+    unsigned int hash;
+    unsigned int refs;
+    unsigned short len;
+    char	s[];
+    } name_t;
+
 typedef struct _file {
-    char	path[FILENAME_MAX];
-    int		mode;
-    time_t	mtime;
+    name_t	*name;		/* last component of the path */
+    struct _file *parent;
+    struct _file *child;	/* first entry of a directory */
+    struct _file *next, *prev;	/* entries of the same directory */
+    struct _file *hnext;	/* next file in the same hash bucket */
+    struct _file *lnext;	/* limbo and free list */
 
+    int		mode;
     int		inode;
+    unsigned int generation;	/* changes when the inode is reused */
+    int		nlookup;	/* references held by the kernel (-l) */
     int		used;
     int		deleted;
+    int		live;		/* entries that are not deleted */
+    int		ttl;		/* ms the controller's data is fresh */
+    time_t	mtime;
+
     buf_t	*buf;		/* M_USER files store the data. */
+    long long	expires;
+    buf_t	*cache;
+    int		fetching;	/* a read-ahead is on its way */
+
+    struct stat	st;		/* attributes, see d_stat() */
+    unsigned int stseq;		/* odd while st is written */
+    unsigned int version;	/* of buf */
+    unsigned int kversion;	/* in the kernel's page cache */
     } file_t;
 
+typedef struct _handle {
+    file_t	*file;
+    buf_t	*buf;
+    struct _request *req;	/* READ reply that is still coming in */
+
+    int		wstream;	/* buf holds data after `sent` bytes */
+    off_t	sent;
+    pthread_mutex_t lock;
+    } handle_t;
+
+  /*
+   * Files and names are allocated from large blocks.  Names
+   * that are no longer used are kept for reuse in lists by
+   * their size (in units of N_UNIT bytes).
+   */
+
+#define	A_BLOCK		65536
+#define	N_UNIT		16
+#define	N_CLASSES	32
+
+  /*
+   * Deleted files are reclaimed when there are at least
+   * C_MIN_DEAD of them and they are more than a quarter of
+   * all files or more than C_MAX_DEAD.  The inode table is
+   * swept in batches of C_BATCH inodes.
+   */
+
+#define	C_MIN_DEAD	64
+#define	C_MAX_DEAD	4096
+#define	C_BATCH		1024
+
+typedef struct _arena {
+    char	*block;
+    size_t	here, size;
+    size_t	total;		/* bytes allocated */
+    } arena_t;
+
 typedef struct _dir {
 
-    /* file[0 .. max] has [0 .. len] valid entries. */
-    file_t	**file;
-    int		len, max;
+    /*
+     * The files form a tree below the root directory, which
+     * is inode 1.  They are also indexed by their inode number ...
+     */
+
+    file_t	*root;
+    file_t	**inode;
+    int		inode_max;
+
+    /* ... and by their parent and name. */
+    file_t	**hash;
+    unsigned int hash_size, hash_count;
+
+    name_t	**name;
+    unsigned int name_size, name_count;
+    name_t	*name_free[N_CLASSES];
+
+    arena_t	arena;
+    unsigned int file_count;
+
+    /*
+     * Lookups take no lock (see e_enter()).  Reclaimed files,
+     * released names and replaced tables wait in limbo until
+     * a compaction finds that no reader that could have seen
+     * them is left, then they are reused or freed.  Free files
+     * keep their inode number.  `seq` is odd while a table is
+     * rebuilt, lookups that overlap that start again.
+     */
+
+    unsigned int dead;		/* deleted files */
+    unsigned int generation;
+    int		compacting;
+    file_t	*limbo, *free;
+    struct _retired *retired;	/* since the last compaction */
+    struct _retired *reclaim;	/* waiting with limbo */
+    unsigned long limbo_epoch;
+    unsigned int seq;
     } dir_t;
 
-static int add_file(dir_t *d, const char *path, const int mode);
+typedef struct _retired {
+    struct _retired *next;
+    void	*p;
+    int		class;		/* of a name_t, -1 for tables */
+    } retired_t;
+
+static file_t *add_file(dir_t *d, const char *path, const int mode);
+
+
+typedef struct _request {
+    int		tag;
+    int		flags;
+    buf_t	*reply;
+
+    int		rc, done;
+    int		ttl;
+    pthread_cond_t cond;
+    struct _request *next;
+
+    struct _channel *ch;
+    int		orphan;		/* the handle is closed, free on completion */
+
+    const char	*cmd, *par;	/* the request for the writer thread */
+    buf_t	*data;
+    int		sent;		/* 1: written, -1: failed */
+    struct _request *qnext;
+    file_t	*file;		/* C_PREFETCH: the file to cache */
+    } req_t;
+
+typedef struct _channel {
+    int		num;
+    int		fd0, fd1;
+    int		sock;		/* passes memory files, or -1 */
+    buf_t	buf;
+    pid_t	pid;
+
+    /*
+     * Requests that wait for the controller's reply.  In
+     * tagged mode replies are matched by their tag, otherwise
+     * the controller answers in order.
+     */
+
+    int		tag_count;
+    req_t	*pending;
+    int		waiting;	/* registered and not complete */
+    int		waiting_max;
+
+    /*
+     * Requests to send.  Workers push them without locking,
+     * the writer thread takes all of them at once.
+     */
+
+    req_t	*queue;
+    sem_t	queued;
+
+    pthread_mutex_t lock;	/* pending list */
+    pthread_cond_t idle;	/* waiting dropped to 0 */
+    pthread_t	reader, writer;
+    int		have_threads;
+
+    int		proto;		/* 2: data blocks are length-prefixed,
+				   3: and may be memory files */
+    buf_t	out;		/* request assembly, writer thread */
+    struct iovec *iov;		/* pieces to write, writer thread */
+    int		iov_size;
+    int		niov, mark;	/* used entries, text in out.buffer */
+    } chan_t;
+
+
+  /*
+   * Operations with latency statistics.
+   */
+
+#define	S_GETATTR	0
+#define	S_OPEN		1
+#define	S_READ		2
+#define	S_WRITE		3
+#define	S_RELEASE	4
+#define	S_READDIR	5
+#define	S_CONTROLLER	6	/* round trip of a request */
+#define	S_OPS		7
+#define	S_BUCKETS	32
+
+#define	S_MKDIR		7	/* only recorded with -R */
+#define	S_UNLINK	8
+#define	S_RMDIR		9
+#define	S_RENAME	10
+#define	S_CREATE	11
+
+  /*
+   * uxfs' own files are below S_DIR, the controller can't
+   * define files there.
+   */
+
+#define	S_DIR		"/.uxfs"
+#define	S_FILE		"/.uxfs/stats"
+
+typedef struct _stats {
+    struct _stats *next;
+    int		used;		/* owned by a running thread */
 
+    unsigned long count[S_OPS];
+    unsigned long long time[S_OPS];	/* ns */
+    unsigned long hist[S_OPS][S_BUCKETS];
+
+    unsigned long lock_waits;	/* contended tree lock acquisitions */
+    unsigned long long lock_time;	/* ns spent waiting */
+    long	bufs, chunks;	/* allocated minus freed */
+
+    unsigned long epoch;	/* while in e_enter(), else 0 */
+    int		depth;
+    } stats_t;
+
+  /*
+   * The recording (-R) starts with REC_MAGIC, each record is
+   * a record_t followed by up to two '\0'-terminated strings
+   * and `data` bytes:
+   *
+   *	REC_OP		path, for S_RENAME also the target
+   *	REC_REQUEST	command and parameter
+   *	REC_REPLY	the reply's data
+   *	REC_FILE	the file definition
+   *
+   * ux-replay.c has a copy of these definitions.
+   */
+
+#define	REC_MAGIC	"UXFSREC1"
+#define	REC_OP		1
+#define	REC_REQUEST	2
+#define	REC_REPLY	3
+#define	REC_FILE	4
+
+typedef struct _record {
+    unsigned int length;	/* of the record and its payload */
+    unsigned int data;
+    unsigned short type;
+    unsigned short op;		/* S_GETATTR ... */
+    int		thread;		/* REC_OP: thread, else channel */
+    int		tag;		/* request and reply */
+    int		rc;		/* result, reply status */
+    int		flags;		/* open flags, reply TTL */
+    int		pad;
+    long long	time;		/* ns since recording started */
+    long long	duration;	/* ns */
+    unsigned long long fh;	/* file handle */
+    long long	offset;
+    long long	size;		/* read/write size, request data */
+    } record_t;
 
 
 typedef struct _uxfs {
@@ -114,30 +413,66 @@ typedef struct _uxfs {
     char	*mountpoint;
     uid_t	uid;
     gid_t	gid;
+    struct fuse	*fuse;
 
-    struct {
-	int	fd0, fd1;
-	buf_t	buf;
+    int		lowlevel;	/* -l: use the inode based API */
+    struct fuse_session *se;
+    struct fuse_chan *chan;
+    double	attr_timeout, entry_timeout;	/* -c, with -l */
 
+    struct {
 	int	argc;
 	char	*argv[MAX_ARGS];
-	pid_t	pid;
+	int	tagged;
+
+	/*
+	 * ch[0] is the primary controller, it receives INIT and
+	 * FILEOP.  With -j there are more copies of it and file
+	 * requests are distributed between them.
+	 */
+
+	int	jobs;
+	unsigned int rr;
+	unsigned int batch;	/* -b: ms to collect tagged requests */
+	chan_t	ch[MAX_JOBS];
 	} co;
 
     int		n_open, n_close;
+    int		n_cache_hit, n_cache_miss;
+    int		n_read, n_write;	/* controller I/O system calls */
     int		inode_count;
+    long long	started;
+    char	*record;	/* -R: file for the recording */
 
-    dir_t	dir;	/* Everything is stored in one directory list. */
+    dir_t	dir;	/* The file tree and its indexes. */
     } uxfs_t;
 
 static int add_file_from_definition(char *line);
 
-static file_t *f_alloc();
+static file_t *f_alloc(dir_t *d);
+static void f_push(file_t *f, buf_t *b);
+static void f_uncache(file_t *f);
+static void f_prefetched(file_t *f, buf_t *b);
+static file_t *getfile(dir_t *d, const char *path, int deleted);
+static int h_flush(handle_t *h, int all);
+static void b_append(buf_t *b, const char *data, int len);
+static char *b_piece(buf_t *b, int i, int *len);
+static char *d_path(const file_t *f, char *path, int size);
 
 static int do_open(const char *path, struct fuse_file_info *fi);
 
 static uxfs_t uxfs;
-static pthread_mutex_t lock;
+
+  /*
+   * `lock` protects the directory tree and the data kept in
+   * file_t.  Changes of the tree take it exclusive, readers of
+   * file data take it shared.  Lookups, getattr and directory
+   * listings take no lock, see e_enter().  The data of an open
+   * file is protected by the lock of its handle, controller
+   * I/O by the channel's locks.
+   */
+
+static pthread_rwlock_t lock;
 
 
 
@@ -148,15 +483,27 @@ static pthread_mutex_t lock;
 #define	OPT_VERBOSE		3
 #define	OPT_OTHER_USERS		4
 #define	OPT_SINGLE_THREAD	5
+#define	OPT_TAGGED		6
+#define	OPT_LOWLEVEL		7
 
 static struct fuse_opt uxfs_opts[] = {
     UXFS_OPT("dbg=%u",		debug, 0),
+    UXFS_OPT("-j %u",		co.jobs, 0),
+    UXFS_OPT("-j%u",		co.jobs, 0),
+    UXFS_OPT("-b %u",		co.batch, 0),
+    UXFS_OPT("-b%u",		co.batch, 0),
+    UXFS_OPT("-R %s",		record, 0),
+    UXFS_OPT("-R%s",		record, 0),
+    UXFS_OPT("-c %lf",		attr_timeout, 0),
+    UXFS_OPT("-c%lf",		attr_timeout, 0),
 
     FUSE_OPT_KEY("-f",		OPT_FOREGROUND),
     FUSE_OPT_KEY("-d",		OPT_DEBUG),
     FUSE_OPT_KEY("-v",		OPT_VERBOSE),
     FUSE_OPT_KEY("-o",		OPT_OTHER_USERS),
     FUSE_OPT_KEY("-s",		OPT_SINGLE_THREAD),
+    FUSE_OPT_KEY("-t",		OPT_TAGGED),
+    FUSE_OPT_KEY("-l",		OPT_LOWLEVEL),
 
     FUSE_OPT_END
     };
@@ -165,8 +512,20 @@ static struct fuse_opt uxfs_opts[] = {
 
 static void __exit()
 {
-	struct fuse_context *ctx = fuse_get_context();
-	struct fuse *fo = ctx->fuse;
+	struct fuse *fo = uxfs.fuse;
+
+	if (uxfs.se != NULL) {
+		fuse_session_exit(uxfs.se);
+		return;
+		}
+
+	/*
+	 * The controller's reader thread is not a libfuse thread
+	 * and has no fuse context, use the one saved by do_init().
+	 */
+
+	if (fo == NULL)
+		fo = fuse_get_context()->fuse;
 
 	fuse_exit (fo);
 }
@@ -239,6 +598,52 @@ static char *m_copy(char *d, const char *s, int len)
 	return (d);
 }
 
+static long long m_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+static unsigned int m_hash(const char *s)
+{
+	unsigned int h;
+
+	for (h = 5381; *s != '\0'; s++)
+		h = h * 33 + (unsigned char) *s;
+
+	return (h);
+}
+
+static unsigned int m_hash_len(const char *s, int len)
+{
+	unsigned int h;
+
+	for (h = 5381; len > 0; s++, len--)
+		h = h * 33 + (unsigned char) *s;
+
+	return (h);
+}
+
+static void *a_alloc(arena_t *a, size_t n)
+{
+	void	*p;
+
+	n = (n + 7) & ~7;
+	if (a->block == NULL  ||  a->here + n > a->size) {
+		a->size  = (n > A_BLOCK)? n: A_BLOCK;
+		a->block = malloc(a->size);
+		a->here  = 0;
+		a->total += a->size;
+		}
+
+	p = &a->block[a->here];
+	a->here += n;
+
+	return (p);
+}
+
 static char *m_getword(char **from, int delim, char *to, int max)
 {
 	char	c;
@@ -274,995 +679,3596 @@ static char *m_getword(char **from, int delim, char *to, int max)
 
 
 /*
- * Buffer spaces
+ * Statistics
  */
 
-static buf_t *b_alloc()
+  /*
+   * Each thread counts into a stats_t of its own, the counters
+   * are added up when /.uxfs/stats is read.  Latencies are
+   * sorted into buckets by powers of two: bucket k holds the
+   * operations that took less than 2^k microseconds.  The
+   * stats_t of a terminated thread is taken over by the next
+   * new thread.
+   */
+
+static stats_t	*s_all;
+static __thread stats_t *s_mine;
+static pthread_key_t s_key;
+static pthread_once_t s_once = PTHREAD_ONCE_INIT;
+
+static const char *s_opname[S_OPS] = {
+	"getattr", "open", "read", "write", "release", "readdir",
+	"controller"
+	};
+
+static long long s_clock()
 {
-	buf_t *b = malloc(sizeof(buf_t));
-	memset(b, 0, sizeof(buf_t));
-	return (b);
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((long long) ts.tv_sec * 1000000000 + ts.tv_nsec);
 }
 
-static void b_free(buf_t *b)
+static void s_exit(void *arg)
 {
-	if (b != NULL) {
-		if (b->buffer != NULL)
-			free (b->buffer);
-		
-		free (b);
-		}
+	stats_t	*s = arg;
+
+	__sync_lock_release(&s->used);
 }
 
-static buf_t *b_clear(buf_t *b)
+static void s_key_init()
 {
-	b->here = b->end = 0;
-	if (b->buffer == NULL) {
-		b->size = LINE_MAX;
-		b->buffer = malloc(b->size);
+	pthread_key_create(&s_key, s_exit);
+}
+
+static stats_t *s_local()
+{
+	stats_t	*s;
+
+	if ((s = s_mine) != NULL)
+		return (s);
+
+	pthread_once(&s_once, s_key_init);
+	for (s = s_all; s != NULL; s = s->next) {
+		if (__sync_bool_compare_and_swap(&s->used, 0, 1) != 0)
+			break;
 		}
 
-	return (b);
+	if (s == NULL) {
+		s = calloc(1, sizeof(stats_t));
+		s->used = 1;
+		do {
+			s->next = s_all;
+			} while (__sync_bool_compare_and_swap(&s_all, s->next, s) == 0);
+		}
+
+	pthread_setspecific(s_key, s);
+	s_mine = s;
+	return (s);
 }
 
-static void b_append_line(buf_t *b, const char *line)
+static void s_stop(int op, long long start)
 {
-	int len = strlen(line);
-	if (b->end + len + MIN_FREE > b->size) {
-		b->size += len + MIN_FREE + LINE_MAX;
-		b->buffer = realloc(b->buffer, b->size);
-		}
+	int	k = 0;
+	long long ns = s_clock() - start;
+	unsigned long long us = ns / 1000;
+	stats_t	*s = s_local();
 
-	strcpy(&b->buffer[b->end], line);
-	b->end += len;
-	b->buffer[b->end++] = '\n';
-	b->buffer[b->end]   = '\0';
+	if (us > 0  &&  (k = 64 - __builtin_clzll(us)) >= S_BUCKETS)
+		k = S_BUCKETS - 1;
+
+	s->count[op]++;
+	s->time[op] += ns;
+	s->hist[op][k]++;
 }
 
-static buf_t *b_from_strings(int count, ...)
+  /*
+   * s_rdlock() and s_wrlock() take the tree lock and count the
+   * time spent waiting for it.  Uncontended locks are not
+   * timed.
+   */
+
+static void s_rdlock()
 {
-	int	i;
-	char	*line;
-	buf_t	*b = b_alloc();
-	va_list	ap;
+	long long start;
+	stats_t	*s;
 
-	va_start(ap, count);
-	for (i = 0; i < count; i++) {
-		line = va_arg(ap, char *);
-		b_append_line(b, line);
-		}
+	if (pthread_rwlock_tryrdlock(&lock) == 0)
+		return;
+
+	start = s_clock();
+	pthread_rwlock_rdlock(&lock);
+	s = s_local();
+	s->lock_waits++;
+	s->lock_time += s_clock() - start;
+}
+
+static void s_wrlock()
+{
+	long long start;
+	stats_t	*s;
+
+	if (pthread_rwlock_trywrlock(&lock) == 0)
+		return;
+
+	start = s_clock();
+	pthread_rwlock_wrlock(&lock);
+	s = s_local();
+	s->lock_waits++;
+	s->lock_time += s_clock() - start;
+}
+
+static void s_printf(buf_t *b, const char *format, ...)
+{
+	int	n;
+	char	line[200];
+	va_list	ap;
 
+	va_start(ap, format);
+	n = vsnprintf (line, sizeof(line), format, ap);
 	va_end(ap);
-	return (b);
+
+	b_append(b, line, (n < sizeof(line))? n: sizeof(line) - 1);
 }
 
-static char *b_getline(buf_t *b, char *line, int size)
+static unsigned long s_percentile(unsigned long *hist, unsigned long count,
+			int permille)
 {
-	int	c, k;
+	int	k;
+	unsigned long n = 0, want;
 
 	/*
-	 * Look for a line terminator between b->here and b->end,
-	 * copy the data to line and keep the buffer intact.
-	 *
-	 * Q: Merge with b_gets()?
+	 * Returns the upper bound of the bucket that holds the
+	 * percentile, in microseconds.
 	 */
 
-	size -= MIN_FREE;
-	if (b->here >= b->end)
-		return (NULL);
-
-	k = 0;
-	while (b->here < b->end) {
-		if ((c = b->buffer[b->here++]) == '\n') {
-			line[k] = '\0';
-			return (line);
-			}
+	if (count == 0)
+		return (0);
 
-		if (k < size)
-			line[k++] = c;
+	want = (count * permille + 999) / 1000;
+	for (k = 0; k < S_BUCKETS - 1; k++) {
+		if ((n += hist[k]) >= want)
+			break;
 		}
 
-	line[k] = '\0';
-	return (line);
+	return (1UL << k);
 }
 
-static int b_gets(buf_t *b, char *line, int size)
+static void s_report(buf_t *b)
 {
-	int	c, have_line = 0, len;
+	int	i, k;
+	long	bufs = 0, chunks = 0;
+	unsigned long lock_waits = 0;
+	unsigned long long lock_time = 0;
+	stats_t	*s, sum;
+	chan_t	*ch;
 
 	/*
-	 * Look for a line terminator between b->here and b->end.
+	 * The other threads' counters are read while they may
+	 * change, the report is a close estimate.
 	 */
 
-	while (b->here < b->end) {
-		c = b->buffer[b->here++];
+	memset(&sum, 0, sizeof(sum));
+	for (s = s_all; s != NULL; s = s->next) {
+		for (i = 0; i < S_OPS; i++) {
+			sum.count[i] += s->count[i];
+			sum.time[i]  += s->time[i];
+			for (k = 0; k < S_BUCKETS; k++)
+				sum.hist[i][k] += s->hist[i][k];
+			}
 
-		if (c == '\n') {
+		lock_waits += s->lock_waits;
+		lock_time  += s->lock_time;
+		bufs   += s->bufs;
+		chunks += s->chunks;
+		}
 
-			/*
-			 * Found one.
-			 */
+	s_printf(b, "uptime %lld s\n", (m_now() - uxfs.started) / 1000);
+	s_printf(b, "%-11s %10s %8s %8s %8s %8s %8s\n", "op", "count",
+			"avg_us", "p50_us", "p90_us", "p99_us", "p999_us");
+	for (i = 0; i < S_OPS; i++) {
+		s_printf(b, "%-11s %10lu %8llu %8lu %8lu %8lu %8lu\n",
+				s_opname[i], sum.count[i],
+				(sum.count[i] > 0)? sum.time[i] / sum.count[i] / 1000: 0,
+				s_percentile(sum.hist[i], sum.count[i], 500),
+				s_percentile(sum.hist[i], sum.count[i], 900),
+				s_percentile(sum.hist[i], sum.count[i], 990),
+				s_percentile(sum.hist[i], sum.count[i], 999));
+		}
 
-			have_line = 1;
-			b->buffer[b->here - 1] = '\0';
+	s_printf(b, "lock waits %lu, %llu us\n", lock_waits, lock_time / 1000);
+	for (i = 0; i < uxfs.co.jobs; i++) {
+		ch = &uxfs.co.ch[i];
+		s_printf(b, "channel %d pending %d max %d\n", i,
+				ch->waiting, ch->waiting_max);
+		}
 
-			m_copy(line, b->buffer, size);
+	s_printf(b, "opens %d closes %d cache_hits %d cache_misses %d\n",
+			uxfs.n_open, uxfs.n_close,
+			uxfs.n_cache_hit, uxfs.n_cache_miss);
+	s_printf(b, "controller_writes %d controller_reads %d\n",
+			uxfs.n_write, uxfs.n_read);
+	s_printf(b, "files %u deleted %u file_bytes %lu arena_bytes %lu table_bytes %lu\n",
+			uxfs.dir.file_count, uxfs.dir.dead,
+			(unsigned long) (uxfs.dir.file_count * sizeof(file_t)),
+			(unsigned long) uxfs.dir.arena.total,
+			(unsigned long) (uxfs.dir.inode_max * sizeof(file_t *) +
+				uxfs.dir.hash_size * sizeof(file_t *) +
+				uxfs.dir.name_size * sizeof(name_t *)));
+	s_printf(b, "buffers %ld buffer_bytes %lu chunks %ld chunk_bytes %lu\n",
+			bufs, (unsigned long) (bufs * sizeof(buf_t)),
+			chunks, (unsigned long) (chunks * sizeof(chunk_t)));
+}
 
-			/*
-			 * Remove the line from the buffer and move
-			 * the remaining data to the begin of the
-			 * buffer.
-			 */
 
-			len = b->end - b->here;
-			memmove(b->buffer, &b->buffer[b->here], len);
-			b->here = 0;
-			b->end  = len;
+/*
+ * Epochs
+ */
 
-			break;
-			}
-		}
+  /*
+   * Lookups in the tree take no lock.  A reader enters the
+   * current epoch with e_enter() and leaves it with e_exit(),
+   * its epoch is kept in the thread's stats_t.  Writers still
+   * take the tree lock.  What they unlink stays in memory until
+   * e_quiet() finds no reader in an epoch up to the one that
+   * was current when it was unlinked.
+   *
+   * A reader stays in its epoch for as long as it uses the
+   * files it found.  To keep one longer, e.g. for an open
+   * handle, it takes a reference (`used`, `nlookup`) under the
+   * lock after checking that the file isn't deleted: deleted
+   * files are the only ones a compaction unlinks.
+   */
 
-	return (have_line);
-}
+static unsigned long e_epoch = 1;
 
-static buf_t *b_copy(buf_t *d, buf_t *s)
+static void e_enter()
 {
-	d->mode = s->mode;
-	d->here = s->here;
-	d->end  = s->end;
-	d->size = s->size;
-	d->buffer = malloc(d->size);
-	memmove(d->buffer, s->buffer, d->size);
+	stats_t	*s = s_local();
 
-	return (d);
+	if (s->depth++ == 0) {
+		s->epoch = e_epoch;
+		__sync_synchronize();
+		}
 }
 
-static buf_t *b_buffer_to_file(file_t *f, buf_t *b)
+static void e_exit()
 {
-	if (f->buf != NULL)
-		free(f->buf);
+	stats_t	*s = s_mine;
 
-	f->buf = b;
-	return (NULL);
+	if (--s->depth == 0)
+		__sync_lock_release(&s->epoch);
 }
 
+static unsigned long e_advance()
+{
+	return (__sync_fetch_and_add(&e_epoch, 1));
+}
 
-/*
- * I/O with the controller.
- */
-
-static int c_start_server()
+static int e_quiet(unsigned long epoch)
 {
-	int	pfd0[2], pfd1[2];
-	pid_t	pid = -1;
+	unsigned long e;
+	stats_t	*s;
 
-	if (pipe(pfd0) != 0  ||  pipe(pfd1) != 0)
-		printerror(1, "-ERR", "can't create pipe: %s", strerror(errno));
+	for (s = s_all; s != NULL; s = s->next) {
+		e = __atomic_load_n(&s->epoch, __ATOMIC_ACQUIRE);
+		if (e != 0  &&  e <= epoch)
+			return (0);
+		}
 
-	if ((pid = fork()) < 0)
-		printerror(1, "-ERR", "can't fork(): %s", strerror(errno));
-	else if (pid == 0) {
+	return (1);
+}
 
-		/*
-		 * Connect the process' stdin to our stdout ...
-		 */
 
-		close(pfd0[1]);
-		dup2(pfd0[0], 0);
-		close(pfd0[0]);
+/*
+ * Recording
+ */
 
-		/*
-		 * ... and it's stdout to our stdin.
-		 */
+  /*
+   * With -R uxfs writes a binary log of the FUSE operations,
+   * the controller requests and their replies and the file
+   * definitions.  ux-replay runs the operations again against
+   * a new mount and answers in place of the controller with
+   * the recorded replies.
+   */
 
-		close(pfd1[0]);
-		dup2(pfd1[1], 1);
-		close (pfd1[1]);
+static struct {
+    FILE	*fp;
+    long long	start;
+    int		threads;
+    pthread_mutex_t lock;
+    } rec;
 
-		if (1) {
-			char	pid[20];
+static __thread int r_thread;
 
-			/*
-			 * Set some environment variables.
-			 */
+static int r_open(const char *filename)
+{
+	if ((rec.fp = fopen(filename, "w")) == NULL) {
+		printerror(0, "-ERR", "can't open %s: %s", filename, strerror(errno));
+		return (-1);
+		}
 
-			setenv("UXFS_MOUNT_POINT", uxfs.mountpoint, 1);
-			snprintf (pid, sizeof(pid) - 2, "%d", getppid());
-			setenv("UXFS_PID", pid, 1);
-			}
+	setvbuf(rec.fp, NULL, _IOFBF, 1 << 20);
+	fwrite(REC_MAGIC, 1, strlen(REC_MAGIC), rec.fp);
+	pthread_mutex_init(&rec.lock, NULL);
+	rec.start = s_clock();
+	return (0);
+}
 
-		execvp(uxfs.co.argv[0], uxfs.co.argv);
-		printerror(1, "-ERR", "can't exec %s, error= %s",
-				uxfs.co.argv[0], strerror(errno));
-		exit (1);
+static void r_close()
+{
+	if (rec.fp != NULL) {
+		pthread_mutex_lock(&rec.lock);
+		fclose(rec.fp);
+		rec.fp = NULL;
+		pthread_mutex_unlock(&rec.lock);
 		}
+}
 
-	uxfs.co.pid = pid;
-
+static void r_write(record_t *r, const char *s1, const char *s2, buf_t *data)
+{
+	int	i, len;
+	char	*p;
 
 	/*
-	 * Save the writing side to the process' stdin ...
+	 * The strings are written with their '\0', then the
+	 * data.
 	 */
 
-	uxfs.co.fd0 = pfd1[0];
-	close(pfd0[0]);
+	r->time  -= rec.start;
+	r->data   = (data != NULL)? data->end: 0;
+	r->length = sizeof(record_t) + r->data +
+			((s1 != NULL)? strlen(s1) + 1: 0) +
+			((s2 != NULL)? strlen(s2) + 1: 0);
 
-	/*
-	 * ... and the reading side of its stdout.
-	 */
+	pthread_mutex_lock(&rec.lock);
+	if (rec.fp != NULL) {
+		fwrite(r, sizeof(record_t), 1, rec.fp);
+		if (s1 != NULL)
+			fwrite(s1, 1, strlen(s1) + 1, rec.fp);
 
-	uxfs.co.fd1 = pfd0[1];
-	close(pfd0[0]);
+		if (s2 != NULL)
+			fwrite(s2, 1, strlen(s2) + 1, rec.fp);
 
-	return (pid);
+		for (i = 0; r->data > 0  &&  (p = b_piece(data, i, &len)) != NULL; i++)
+			fwrite(p, 1, len, rec.fp);
+		}
+
+	pthread_mutex_unlock(&rec.lock);
 }
 
-static int c_readinput(int fd, buf_t *b)
+  /*
+   * r_op() records a FUSE operation that started at `start`.
+   * Without `path` the file's path is recorded.  The data of
+   * reads and writes is not recorded, only its size.
+   */
+
+static void r_op(int op, long long start, int rc, const file_t *f,
+			const char *path, const char *to, void *fh,
+			long long offset, long long size, int flags)
 {
-	int	n;
+	char	name[FILENAME_MAX];
+	record_t r;
+
+	if (r_thread == 0)
+		r_thread = __sync_add_and_fetch(&rec.threads, 1);
+
+	memset(&r, 0, sizeof(r));
+	r.type     = REC_OP;
+	r.op       = op;
+	r.thread   = r_thread;
+	r.time     = start;
+	r.duration = s_clock() - start;
+	r.rc       = rc;
+	r.flags    = flags;
+	r.fh       = (unsigned long) fh;
+	r.offset   = offset;
+	r.size     = size;
+	if (path == NULL)
+		path = (f != NULL)? d_path(f, name, sizeof(name)): "";
+
+	r_write(&r, path, to, NULL);
+}
+
+static void r_request(chan_t *ch, req_t *r, const char *cmd,
+			const char *par, buf_t *data)
+{
+	record_t x;
+
+	memset(&x, 0, sizeof(x));
+	x.type   = REC_REQUEST;
+	x.thread = ch->num;
+	x.tag    = r->tag;
+	x.time   = s_clock();
+	x.size   = (data != NULL)? data->end: 0;
+	r_write(&x, cmd, (par != NULL)? par: "", NULL);
+}
+
+static void r_reply(chan_t *ch, req_t *r, int rc)
+{
+	record_t x;
+
+	memset(&x, 0, sizeof(x));
+	x.type   = REC_REPLY;
+	x.thread = ch->num;
+	x.tag    = r->tag;
+	x.time   = s_clock();
+	x.rc     = rc;
+	x.flags  = r->ttl;
+	r_write(&x, NULL, NULL,
+		(rc == 0  &&  (r->flags & C_STATUS) == R_MULTI)? r->reply: NULL);
+}
+
+static void r_file(const char *line)
+{
+	record_t x;
+
+	memset(&x, 0, sizeof(x));
+	x.type = REC_FILE;
+	x.time = s_clock();
+	r_write(&x, line, NULL, NULL);
+}
+
+
+/*
+ * Kernel cache
+ */
+
+  /*
+   * With -l the kernel keeps attributes and entries for the
+   * time given with -c and reads the content of user-created
+   * files through its page cache.  When a file's attributes or
+   * data change k_inval() tells the kernel.  The notifications
+   * are written by a thread of their own: the kernel may wait
+   * for requests that are still being answered before it
+   * returns from one.
+   */
+
+typedef struct _inval {
+    int		inode;
+    int		data;		/* drop the cached data too */
+    } inval_t;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    inval_t	*list;
+    int		count, size;
+    } kc = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static int k_cached(const file_t *f, int mode)
+{
+	return (uxfs.se != NULL  &&  uxfs.attr_timeout > 0  &&
+		(f->mode & (M_USER | M_DIR)) == M_USER  &&
+		(mode & O_ACCMODE) == O_RDONLY);
+}
+
+static void k_inval(const file_t *f, int data)
+{
+
+	/*
+	 * Inodes the kernel doesn't know have nothing cached.
+	 */
+
+	if (uxfs.se == NULL  ||  uxfs.attr_timeout <= 0  ||  f->nlookup == 0)
+		return;
+
+	pthread_mutex_lock(&kc.lock);
+	if (kc.count >= kc.size) {
+		kc.size = 2 * kc.size + 64;
+		kc.list = realloc(kc.list, kc.size * sizeof(inval_t));
+		}
+
+	kc.list[kc.count].inode = f->inode;
+	kc.list[kc.count].data  = data;
+	kc.count++;
+	pthread_cond_signal(&kc.cond);
+	pthread_mutex_unlock(&kc.lock);
+}
+
+static void *k_notifier(void *arg)
+{
+	int	i, n, size = 0;
+	inval_t	*list = NULL;
+
+	while (1) {
+		pthread_mutex_lock(&kc.lock);
+		while (kc.count == 0)
+			pthread_cond_wait(&kc.cond, &kc.lock);
+
+		if (size < kc.count) {
+			size = kc.size;
+			list = realloc(list, size * sizeof(inval_t));
+			}
+
+		memcpy(list, kc.list, kc.count * sizeof(inval_t));
+		n = kc.count;
+		kc.count = 0;
+		pthread_mutex_unlock(&kc.lock);
+
+		/*
+		 * A negative offset invalidates only the attributes.
+		 */
+
+		for (i = 0; i < n; i++) {
+			fuse_lowlevel_notify_inval_inode(uxfs.chan, list[i].inode,
+					(list[i].data != 0)? 0: -1, 0);
+			}
+		}
+
+	return (NULL);
+}
+
+static void k_start()
+{
+	pthread_t th;
+
+	if (uxfs.se == NULL  ||  uxfs.attr_timeout <= 0)
+		return;
+	else if (pthread_create(&th, NULL, k_notifier, NULL) != 0) {
+		printerror(0, "-ERR", "can't create notifier thread: %s",
+				strerror(errno));
+		uxfs.attr_timeout = uxfs.entry_timeout = 0;
+		return;
+		}
+
+	pthread_detach(th);
+}
+
+
+/*
+ * Buffer spaces
+ */
+
+static buf_t *b_alloc()
+{
+	buf_t *b = malloc(sizeof(buf_t));
+	memset(b, 0, sizeof(buf_t));
+	s_local()->bufs++;
+	return (b);
+}
+
+static void b_unref(chunk_t *c)
+{
+	if (c != NULL  &&  __sync_sub_and_fetch(&c->refs, 1) == 0) {
+		s_local()->chunks--;
+		free(c);
+		}
+}
+
+static void b_free(buf_t *b)
+{
+	int	i;
+
+	if (b != NULL) {
+		if (b->buffer != NULL)
+			free (b->buffer);
+		
+		for (i = 0; i < b->chunks; i++)
+			b_unref(b->chunk[i]);
 
+		if (b->chunk != NULL)
+			free (b->chunk);
+
+		free (b);
+		s_local()->bufs--;
+		}
+}
+
+static buf_t *b_clear(buf_t *b)
+{
+	b->here = b->end = 0;
 	if (b->buffer == NULL) {
-		b->here = b->end = 0;
 		b->size = LINE_MAX;
 		b->buffer = malloc(b->size);
 		}
 
-	/*
-	 * Resize buffer if necessary.
-	 */
+	return (b);
+}
 
-	if (b->size - b->end < LINE_MAX) {
-		b->size += LINE_MAX;
+static void b_append(buf_t *b, const char *data, int len)
+{
+	if (b->end + len + MIN_FREE > b->size) {
+		b->size = 2 * b->size + len + MIN_FREE;
 		b->buffer = realloc(b->buffer, b->size);
 		}
 
+	memmove(&b->buffer[b->end], data, len);
+	b->end += len;
+	b->buffer[b->end] = '\0';
+}
+
+static void b_append_line(buf_t *b, const char *line)
+{
+	b_append(b, line, strlen(line));
+	b_append(b, "\n", 1);
+}
+
+static buf_t *b_from_strings(int count, ...)
+{
+	int	i;
+	char	*line;
+	buf_t	*b = b_alloc();
+	va_list	ap;
+
+	va_start(ap, count);
+	for (i = 0; i < count; i++) {
+		line = va_arg(ap, char *);
+		b_append_line(b, line);
+		}
+
+	va_end(ap);
+	return (b);
+}
+
+static char *b_nextline(buf_t *b, int *len)
+{
+	char	*p, *q;
+
 	/*
-	 * Read the input ...
+	 * Return the next complete line between b->here and
+	 * b->end without copying it.  The newline is replaced
+	 * by '\0' and b->here moves behind it.
 	 */
 
-	n = read(fd, &b->buffer[b->end], b->size - b->end - 2);
-	b->end += n;
+	if (b->here >= b->end)
+		return (NULL);
 
-	return (n);
+	p = &b->buffer[b->here];
+	if ((q = memchr(p, '\n', b->end - b->here)) == NULL)
+		return (NULL);
+
+	*q   = '\0';
+	*len = q - p;
+	b->here += *len + 1;
+
+	return (p);
 }
 
-static char *c_gets(char *line, const int size, const int debug)
+static buf_t *b_copy(buf_t *d, buf_t *s)
 {
-	while (b_gets(&uxfs.co.buf, line, size) == 0) {
-		if (c_readinput(uxfs.co.fd0, &uxfs.co.buf) <= 0) {
-			printerror(1, "-ERR", "controller closed connecction");
-			return (NULL);
+	int	i;
+
+	d->mode = s->mode;
+	d->here = s->here;
+	d->end  = s->end;
+
+	/*
+	 * Chunks are not copied, the copy takes a reference.
+	 */
+
+	if (s->buffer == NULL) {
+		d->chunks = (s->end + CHUNK_SIZE - 1) / CHUNK_SIZE;
+		d->chunk  = calloc(d->chunks + 1, sizeof(chunk_t *));
+		for (i = 0; i < d->chunks; i++) {
+			if ((d->chunk[i] = s->chunk[i]) != NULL)
+				__sync_fetch_and_add(&d->chunk[i]->refs, 1);
 			}
+
+		return (d);
 		}
 
-	if (debug != 0  &&  uxfs.debug != 0)
-		fprintf (stderr, "<< %s\n", line);
+	d->size = s->size;
+	d->buffer = malloc(d->size);
+	memmove(d->buffer, s->buffer, d->size);
 
-	return (line);
+	return (d);
 }
 
-static int c_puts(int debug, const char *format, ...)
+static char *b_piece(buf_t *b, int i, int *len)
 {
-	int	n, m;
-	char	line[LINE_MAX];
-	va_list	ap;
+	static chunk_t zero;
 
-	va_start(ap, format);
-	n = vsnprintf (line, sizeof(line) - 2, format, ap);
-	va_end(ap);
+	/*
+	 * Return the i-th contiguous piece of the data: the
+	 * whole buffer or one chunk.
+	 */
 
-	if (uxfs.debug != 0  &&  debug != 0)
-		fprintf (stderr, ">> %s\n", line);
+	if (b->buffer != NULL) {
+		*len = b->end;
+		return ((i == 0)? b->buffer: NULL);
+		}
 
-	if ((m = write(uxfs.co.fd1, line, n)) != strlen(line)) {
-		printerror(1, "-ERR", "server closed connection");
-		n = -1;
+	if ((long long) i * CHUNK_SIZE >= b->end)
+		return (NULL);
+
+	*len = b->end - i * CHUNK_SIZE;
+	if (*len > CHUNK_SIZE)
+		*len = CHUNK_SIZE;
+
+	return ((b->chunk[i] != NULL)? b->chunk[i]->data: zero.data);
+}
+
+static int b_read(buf_t *b, char *data, int size, int offset)
+{
+	int	n, k, len;
+	char	*p;
+
+	if (offset >= b->end)
+		return (0);
+
+	if (size > b->end - offset)
+		size = b->end - offset;
+
+	if (b->buffer != NULL) {
+		memmove(data, &b->buffer[offset], size);
+		return (size);
 		}
 
-	return (n);
+	for (n = 0; n < size; n += k) {
+		p = b_piece(b, (offset + n) / CHUNK_SIZE, &len);
+		p += (offset + n) % CHUNK_SIZE;
+		len -= (offset + n) % CHUNK_SIZE;
+		k = (len < size - n)? len: size - n;
+		memmove(&data[n], p, k);
+		}
+
+	return (size);
 }
 
+static void b_write(buf_t *b, const char *data, int size, int offset)
+{
+	int	i, k, n;
+	char	*p;
+	chunk_t	*c;
 
-  /*
-   * c_putc() sends `cmd` with optional arguments (`formmat`
-   * parameter) to the controller and read the response
-   * inndicated by `resp` into `b`.
-   */
+	/*
+	 * Data in a buffer moves to chunks with the first write.
+	 */
 
-static int c_putc(const char *cmd, const char *par,
-			const int flags, buf_t *data, buf_t *reply) {
-	int	rc = 0;
-	char	*p, line[LINE_MAX];
+	if (b->buffer != NULL) {
+		p = b->buffer;
+		n = b->end;
+		b->buffer = NULL;
+		b->here = b->end = b->size = 0;
+		b_write(b, p, n, 0);
+		free(p);
+		}
 
-	if (cmd != NULL) {
+	if (size <= 0)
+		return;
 
-		/*
-		 * Send the command and parameter.
-		 */
+	if ((n = (offset + size + CHUNK_SIZE - 1) / CHUNK_SIZE) > b->chunks) {
+		if (n < 2 * b->chunks)
+			n = 2 * b->chunks;
 
-		if (par != NULL  &&  *par != '\0')
-			rc = c_puts(1, "%s %s\n", cmd, par);
-		else
-			rc = c_puts(1, "%s\n", cmd);
+		b->chunk = realloc(b->chunk, n * sizeof(chunk_t *));
+		memset(&b->chunk[b->chunks], 0, (n - b->chunks) * sizeof(chunk_t *));
+		b->chunks = n;
+		}
 
-		if (rc <= 0)
-			return (1);
+	if (b->end < offset + size)
+		b->end = offset + size;
 
+	for (; size > 0; size -= n) {
+		i = offset / CHUNK_SIZE;
+		k = offset % CHUNK_SIZE;
+		n = (size < CHUNK_SIZE - k)? size: CHUNK_SIZE - k;
 
 		/*
-		 * Send data to the controller.
+		 * A shared chunk is copied before it is changed.
 		 */
 
-		if (data != NULL) {
-			data->here = 0;
-			while ((p = b_getline(data, line, sizeof(line))) != NULL) {
-				if (*p == '.') {
-					c_puts(0, ".%s\n", p);
-					continue;
-					}
-
-				c_puts(0, "%s\n", p);
-				}
-
-			c_puts(0, ".\n");
+		if ((c = b->chunk[i]) == NULL) {
+			c = calloc(1, sizeof(chunk_t));
+			c->refs = 1;
+			s_local()->chunks++;
+			b->chunk[i] = c;
+			}
+		else if (c->refs > 1) {
+			c = malloc(sizeof(chunk_t));
+			memmove(c->data, b->chunk[i]->data, CHUNK_SIZE);
+			s_local()->chunks++;
+			c->refs = 1;
+			b_unref(b->chunk[i]);
+			b->chunk[i] = c;
 			}
 
-		if ((flags & C_TEMP_DATA) != 0)
-			b_free(data);
+		memmove(&c->data[k], data, n);
+		data   += n;
+		offset += n;
 		}
+}
 
-	if ((flags & C_STATUS) != R_NONE) {
+static buf_t *b_buffer_to_file(file_t *f, buf_t *b)
+{
+	if (f->buf != NULL)
+		b_free(f->buf);
 
-		/*
-		 * Read the controller's response.
-		 */
+	f->buf = b;
+	f->version++;
+	k_inval(f, 1);
+	return (NULL);
+}
 
-		char	*p, *s, token[40], response[200];
-		char	data[LINE_MAX], line[LINE_MAX];
 
-		if ((p = c_gets(line, sizeof(line), 1)) == NULL)
-			return (1);
+/*
+ * I/O with the controller.
+ */
 
-		/*
-		 * Read the first line and get the status token.
-		 */
+static int c_start_server(chan_t *ch)
+{
+	int	pfd0[2], pfd1[2], sv[2] = { -1, -1 };
+	pid_t	pid = -1;
 
-		s = m_getword(&p, ';', response, sizeof(response));
-		m_getword(&s, ' ', token, sizeof(token));
-		if (strcmp(token, "+OK") == 0)
-			rc = 0;
-		else if (strcmp(token, "-ERR") == 0)
-			rc = 1;
-		else {
-			/* This initiates termination of uxfs */
-			printerror(1, "-ERR", "protocol error: %s", line);
-			return (1);
-			}
+	if (pipe(pfd0) != 0  ||  pipe(pfd1) != 0)
+		printerror(1, "-ERR", "can't create pipe: %s", strerror(errno));
 
-		if (rc == 0  &&  (flags & C_STATUS) == R_MULTI) {
-			char	rbuf[LINE_MAX];
+#ifdef MFD_CLOEXEC
 
-			/*
-			 * Read the data response for the REQUEST
-			 * command.
-			 */
+	/*
+	 * Large data blocks can be passed as memory files over
+	 * a socket, see c_putfd().
+	 */
 
-			b_clear(reply);
-			while (c_gets(rbuf, sizeof(rbuf), 0) != NULL) {
-				if (strcmp(rbuf, ".") == 0)
-					break;
-				else if (rbuf[0] == '.') {
-					b_append_line(reply, &rbuf[1]);
-					continue;
-					}
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0)
+		fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+#endif
 
-				b_append_line(reply, rbuf);
-				}
-			}
+#ifdef F_SETPIPE_SZ
+
+	/*
+	 * Larger pipes take a whole request or reply in one
+	 * go.  If the system does not allow it we live with
+	 * the default.
+	 */
+
+	fcntl(pfd0[1], F_SETPIPE_SZ, PIPE_SIZE);
+	fcntl(pfd1[1], F_SETPIPE_SZ, PIPE_SIZE);
+#endif
+
+	/*
+	 * Our ends of the pipes must not be inherited by the
+	 * other controllers, they would never see EOF.
+	 */
+
+	fcntl(pfd0[1], F_SETFD, FD_CLOEXEC);
+	fcntl(pfd1[0], F_SETFD, FD_CLOEXEC);
+
+	if ((pid = fork()) < 0)
+		printerror(1, "-ERR", "can't fork(): %s", strerror(errno));
+	else if (pid == 0) {
 
 		/*
-		 * Read further responses from the first line
-		 * and interpret the commands.
+		 * Connect the process' stdin to our stdout ...
 		 */
 
-		while (*(s = m_getword(&p, ';', response, sizeof(response))) != '\0') {
-			m_getword(&s, ' ', token, sizeof(token));
-			if (strcmp(token, "QUIT") == 0) {
-				__exit();
-				return (0);
-				}
-			else if (strcmp(token, "DIR") == 0) {
-				while (c_gets(data, sizeof(data), 0) != NULL) {
-					if (strcmp(data, ".") == 0)
-						break;
+		close(pfd0[1]);
+		dup2(pfd0[0], 0);
+		close(pfd0[0]);
 
-					add_file_from_definition(data);
-					}
-				}
-			else {
-				/* Again, terminate. */
-				printerror(1, "-ERR", "protocol error: %s", response);
+		/*
+		 * ... and it's stdout to our stdin.
+		 */
+
+		close(pfd1[0]);
+		dup2(pfd1[1], 1);
+		close (pfd1[1]);
+
+		if (1) {
+			char	pid[20];
+
+			/*
+			 * Set some environment variables.
+			 */
+
+			setenv("UXFS_MOUNT_POINT", uxfs.mountpoint, 1);
+			snprintf (pid, sizeof(pid) - 2, "%d", getppid());
+			setenv("UXFS_PID", pid, 1);
+			if (uxfs.co.tagged != 0)
+				setenv("UXFS_TAGGED", "1", 1);
+
+			setenv("UXFS_PROTO", "2", 1);
+			if (sv[1] >= 0) {
+				close(sv[0]);
+				snprintf (pid, sizeof(pid) - 2, "%d", sv[1]);
+				setenv("UXFS_FDSOCK", pid, 1);
+				}
+
+			snprintf (pid, sizeof(pid) - 2, "%d", ch->num);
+			setenv("UXFS_WORKER", pid, 1);
+			snprintf (pid, sizeof(pid) - 2, "%d", uxfs.co.jobs);
+			setenv("UXFS_WORKERS", pid, 1);
+			}
+
+		execvp(uxfs.co.argv[0], uxfs.co.argv);
+		printerror(1, "-ERR", "can't exec %s, error= %s",
+				uxfs.co.argv[0], strerror(errno));
+		exit (1);
+		}
+
+	ch->pid = pid;
+
+
+	/*
+	 * Save the writing side to the process' stdin ...
+	 */
+
+	ch->fd0 = pfd1[0];
+	close(pfd1[1]);
+
+	/*
+	 * ... and the reading side of its stdout.
+	 */
+
+	ch->fd1 = pfd0[1];
+	close(pfd0[0]);
+
+	ch->sock = sv[0];
+	if (sv[1] >= 0)
+		close(sv[1]);
+
+	return (pid);
+}
+
+static char *c_name(chan_t *ch)
+{
+	static char *name[MAX_JOBS] = {
+		"", "1", "2", "3", "4", "5", "6", "7", "8", "9",
+		"10", "11", "12", "13", "14", "15"
+		};
+
+	return (uxfs.co.jobs > 1? name[ch->num]: "");
+}
+
+static int c_readinput(int fd, buf_t *b)
+{
+	int	n;
+
+	if (b->buffer == NULL) {
+		b->here = b->end = 0;
+		b->size = LINE_MAX;
+		b->buffer = malloc(b->size);
+		}
+
+	/*
+	 * Data before b->here is consumed.  The rest is moved to
+	 * the front only if that frees at least half of the buffer,
+	 * otherwise the buffer doubles.  This keeps the copying
+	 * linear for long replies.
+	 */
+
+	if (b->here >= b->end)
+		b->here = b->end = 0;
+	else if (b->here >= b->size / 2) {
+		memmove(b->buffer, &b->buffer[b->here], b->end - b->here);
+		b->end -= b->here;
+		b->here = 0;
+		}
+
+	if (b->size - b->end < LINE_MAX) {
+		b->size *= 2;
+		b->buffer = realloc(b->buffer, b->size);
+		}
+
+	/*
+	 * Read the input ...
+	 */
+
+	n = read(fd, &b->buffer[b->end], b->size - b->end - 2);
+	__sync_fetch_and_add(&uxfs.n_read, 1);
+	if (n > 0)
+		b->end += n;
+
+	return (n);
+}
+
+static char *c_nextline(chan_t *ch, int *len)
+{
+	char	*p;
+
+	while ((p = b_nextline(&ch->buf, len)) == NULL) {
+		if (c_readinput(ch->fd0, &ch->buf) <= 0) {
+			printerror(1, "-ERR", "controller closed connecction");
+			return (NULL);
+			}
+		}
+
+	return (p);
+}
+
+static char *c_gets(chan_t *ch, char *line, const int size, const int debug)
+{
+	int	len;
+	char	*p;
+
+	if ((p = c_nextline(ch, &len)) == NULL)
+		return (NULL);
+
+	m_copy(line, p, size);
+	if (debug != 0  &&  uxfs.debug != 0)
+		fprintf (stderr, "<<%s %s\n", c_name(ch), line);
+
+	return (line);
+}
+
+static int m_writev(int fd, struct iovec *iov, int count)
+{
+	ssize_t	n;
+
+	/*
+	 * Write all pieces, usually with a single system call.
+	 */
+
+	while (count > 0) {
+		__sync_fetch_and_add(&uxfs.n_write, 1);
+		if ((n = writev(fd, iov, (count < MAX_IOV)? count: MAX_IOV)) < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return (-1);
+			}
+
+		while (count > 0  &&  n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			count--;
+			}
+
+		if (count > 0) {
+			iov->iov_base = (char *) iov->iov_base + n;
+			iov->iov_len -= n;
+			}
+		}
+
+	return (0);
+}
+
+static int c_write(chan_t *ch, struct iovec *iov, int count)
+{
+	if (m_writev(ch->fd1, iov, count) != 0) {
+		printerror(1, "-ERR", "server closed connection");
+		return (-1);
+		}
+
+	return (0);
+}
+
+  /*
+   * Protocol v3 passes large data blocks as memory files: the
+   * sender writes the data to a memfd and sends its descriptor
+   * over the channel's socket, the data line "@length" tells
+   * the receiver to take the next descriptor from there.
+   */
+
+static int c_sendfd(chan_t *ch, int fd)
+{
+	char	c = 'F';
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	union {
+	    struct cmsghdr h;
+	    char	b[CMSG_SPACE(sizeof(int))];
+	    } cbuf;
+
+	iov.iov_base = &c;
+	iov.iov_len  = 1;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf.b;
+	msg.msg_controllen = sizeof(cbuf.b);
+
+	cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type  = SCM_RIGHTS;
+	cm->cmsg_len   = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+
+	return ((sendmsg(ch->sock, &msg, MSG_NOSIGNAL) == 1)? 0: -1);
+}
+
+static int c_recvfd(chan_t *ch)
+{
+	int	fd = -1;
+	char	c;
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	union {
+	    struct cmsghdr h;
+	    char	b[CMSG_SPACE(sizeof(int))];
+	    } cbuf;
+
+	if (ch->sock < 0)
+		return (-1);
+
+	iov.iov_base = &c;
+	iov.iov_len  = 1;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf.b;
+	msg.msg_controllen = sizeof(cbuf.b);
+
+	if (recvmsg(ch->sock, &msg, MSG_CMSG_CLOEXEC) != 1)
+		return (-1);
+
+	if ((cm = CMSG_FIRSTHDR(&msg)) != NULL  &&
+	    cm->cmsg_level == SOL_SOCKET  &&  cm->cmsg_type == SCM_RIGHTS)
+		memcpy(&fd, CMSG_DATA(cm), sizeof(int));
+
+	return (fd);
+}
+
+static int c_putfd(chan_t *ch, buf_t *data)
+{
+	int	i, n, len, fd, rc = 0;
+	char	*p;
+	struct iovec iov[64];
+
+#ifdef MFD_CLOEXEC
+	if ((fd = memfd_create("uxfs", MFD_CLOEXEC)) < 0)
+		return (-1);
+#else
+	return (-1);
+#endif
+
+	for (i = n = 0; rc == 0  &&  (p = b_piece(data, i, &len)) != NULL; i++) {
+		iov[n].iov_base = p;
+		iov[n].iov_len  = len;
+		if (++n == sizeof(iov) / sizeof(iov[0])) {
+			rc = m_writev(fd, iov, n);
+			n = 0;
+			}
+		}
+
+	if (rc == 0  &&  n > 0)
+		rc = m_writev(fd, iov, n);
+
+	if (rc == 0)
+		rc = c_sendfd(ch, fd);
+
+	close(fd);
+	return (rc);
+}
+
+static int m_readfd(int fd, char *data, int n)
+{
+	int	k = 0, m;
+
+	while (k < n) {
+		if ((m = pread(fd, &data[k], n - k, k)) < 0  &&  errno == EINTR)
+			continue;
+		else if (m <= 0)
+			return (-1);
+
+		k += m;
+		}
+
+	return (k);
+}
+
+
+static int c_readsome(chan_t *ch, char *data, int n)
+{
+	int	k;
+	buf_t	*b = &ch->buf;
+
+	/*
+	 * Take what is already in the input buffer or read
+	 * directly.
+	 */
+
+	if (b->buffer != NULL  &&  b->here < b->end) {
+		k = (b->end - b->here < n)? b->end - b->here: n;
+		memmove(data, &b->buffer[b->here], k);
+		b->here += k;
+		return (k);
+		}
+
+	__sync_fetch_and_add(&uxfs.n_read, 1);
+	if ((k = read(ch->fd0, data, n)) <= 0) {
+		printerror(1, "-ERR", "controller closed connecction");
+		return (-1);
+		}
+
+	return (k);
+}
+
+static int c_readdata(chan_t *ch, char *data, int n)
+{
+	int	k = 0, m;
+
+	while (k < n) {
+		if ((m = c_readsome(ch, &data[k], n - k)) <= 0)
+			return (-1);
+
+		k += m;
+		}
+
+	return (k);
+}
+
+static int c_getdata(chan_t *ch, buf_t *b)
+{
+	int	n, k, fd = -1;
+	char	*p, line[LINE_MAX];
+
+	b_clear(b);
+
+	/*
+	 * Protocol v2 sends a line "=length" and then the raw data,
+	 * in v3 "@length" means the data is in a memory file.
+	 */
+
+	if (ch->proto >= 2) {
+		if (c_gets(ch, line, sizeof(line), 0) == NULL)
+			return (1);
+		else if ((line[0] != '='  &&  line[0] != '@')  ||
+			 (n = atoi(&line[1])) < 0  ||
+			 (line[0] == '@'  &&  (fd = c_recvfd(ch)) < 0)) {
+			printerror(1, "-ERR", "protocol error: %s", line);
+			return (1);
+			}
+
+		if (b->size < n + MIN_FREE) {
+			b->size = n + MIN_FREE;
+			b->buffer = realloc(b->buffer, b->size);
+			}
+
+		if (fd >= 0) {
+			k = m_readfd(fd, b->buffer, n);
+			close(fd);
+			if (k < 0)
 				return (1);
+			}
+		else if (c_readdata(ch, b->buffer, n) < 0)
+			return (1);
+
+		b->end = n;
+		b->buffer[n] = '\0';
+		return (0);
+		}
+
+	/*
+	 * Otherwise read a dot-terminated data block into `b`.
+	 */
+
+	while ((p = c_nextline(ch, &n)) != NULL) {
+		if (strcmp(p, ".") == 0)
+			return (0);
+		else if (*p == '.') {
+			p++;
+			n--;
+			}
+
+		b_append(b, p, n);
+		b_append(b, "\n", 1);
+		}
+
+	return (1);
+}
+
+static void c_publish(chan_t *ch, req_t *r, buf_t *t)
+{
+	pthread_mutex_lock(&ch->lock);
+	b_append(r->reply, t->buffer, t->end);
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&ch->lock);
+
+	t->end = 0;
+}
+
+static int c_getstream(chan_t *ch, req_t *r)
+{
+	int	n, k, len, fd = -1, rc = 1;
+	char	*p, line[LINE_MAX];
+	buf_t	t;
+
+	/*
+	 * Read a data block for a streaming request.  The data
+	 * goes to the request's buffer in pieces, whenever the
+	 * input runs dry, and waiting readers are woken up.
+	 */
+
+	memset(&t, 0, sizeof(t));
+	t.buffer = malloc(t.size = STREAM_CHUNK + MIN_FREE);
+
+	if (ch->proto >= 2) {
+		if (c_gets(ch, line, sizeof(line), 0) == NULL)
+			;
+		else if ((line[0] != '='  &&  line[0] != '@')  ||
+			 (n = atoi(&line[1])) < 0  ||
+			 (line[0] == '@'  &&  (fd = c_recvfd(ch)) < 0))
+			printerror(1, "-ERR", "protocol error: %s", line);
+		else {
+			for (k = 0; n > 0; n -= len, k += len) {
+				len = (n < STREAM_CHUNK)? n: STREAM_CHUNK;
+				if (fd >= 0)
+					len = pread(fd, t.buffer, len, k);
+				else
+					len = c_readsome(ch, t.buffer, len);
+
+				if (len <= 0)
+					break;
+
+				/*
+				 * c_publish() resets t.end.
+				 */
+
+				t.end = len;
+				c_publish(ch, r, &t);
+				}
+
+			rc = (n > 0);
+			if (fd >= 0)
+				close(fd);
+			}
+		}
+	else {
+		while (rc != 0) {
+			while ((p = b_nextline(&ch->buf, &n)) != NULL) {
+				if (strcmp(p, ".") == 0) {
+					rc = 0;
+					break;
+					}
+				else if (*p == '.') {
+					p++;
+					n--;
+					}
+
+				b_append(&t, p, n);
+				b_append(&t, "\n", 1);
+				}
+
+			if (t.end > 0)
+				c_publish(ch, r, &t);
+
+			if (rc != 0  &&  c_readinput(ch->fd0, &ch->buf) <= 0) {
+				printerror(1, "-ERR", "controller closed connecction");
+				break;
 				}
 			}
 		}
 
-	return (rc);
+	free(t.buffer);
+	return (rc);
+}
+
+static int c_getdir(chan_t *ch)
+{
+	char	line[LINE_MAX];
+
+	/*
+	 * Read a block of file definitions.
+	 */
+
+	while (c_gets(ch, line, sizeof(line), 0) != NULL) {
+		if (strcmp(line, ".") == 0)
+			return (0);
+
+		add_file_from_definition(line);
+		}
+
+	return (1);
+}
+
+static req_t *c_getrequest(chan_t *ch, int tag)
+{
+	req_t	*r, **rp;
+
+	/*
+	 * Find the request the controller is replying to and
+	 * remove it from the pending list.  Untagged replies
+	 * belong to the oldest request.
+	 */
+
+	pthread_mutex_lock(&ch->lock);
+	for (rp = &ch->pending; (r = *rp) != NULL; rp = &r->next) {
+		if (uxfs.co.tagged == 0  ||  r->tag == tag) {
+			*rp = r->next;
+			break;
+			}
+		}
+
+	pthread_mutex_unlock(&ch->lock);
+	return (r);
+}
+
+static void c_free(req_t *r)
+{
+	b_free(r->reply);
+	pthread_cond_destroy(&r->cond);
+	free(r);
+}
+
+static void c_complete(chan_t *ch, req_t *r, int rc)
+{
+	int	sent;
+
+	if (rec.fp != NULL)
+		r_reply(ch, r, rc);
+
+	if ((r->flags & C_PREFETCH) != 0) {
+		r->reply->ttl = r->ttl;
+		f_prefetched(r->file, (rc == 0)? r->reply: NULL);
+		}
+
+	pthread_mutex_lock(&ch->lock);
+	r->rc   = rc;
+	r->done = 1;
+	if (--ch->waiting == 0)
+		pthread_cond_broadcast(&ch->idle);
+
+	/*
+	 * Nobody waits for orphaned streams and read-aheads, they
+	 * are freed when they are sent and complete.
+	 */
+
+	if (r->orphan != 0) {
+		sent = r->sent;
+		pthread_mutex_unlock(&ch->lock);
+		if (sent != 0)
+			c_free(r);
+
+		return;
+		}
+
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&ch->lock);
+}
+
+static int c_reply(chan_t *ch, char *line)
+{
+	int	rc, tag = 0;
+	char	*p, *s, *t, token[40], response[200];
+	req_t	*r;
+
+	/*
+	 * Read the first line and get the status token.  In tagged
+	 * mode the token carries the request's tag, e.g. "+OK#17".
+	 */
+
+	p = line;
+	s = m_getword(&p, ';', response, sizeof(response));
+	m_getword(&s, ' ', token, sizeof(token));
+	if ((t = strchr(token, '#')) != NULL) {
+		*t++ = '\0';
+		tag = atoi(t);
+		}
+
+	if (strcmp(token, "+OK") == 0)
+		rc = 0;
+	else if (strcmp(token, "-ERR") == 0)
+		rc = 1;
+	else {
+		/* This initiates termination of uxfs */
+		printerror(1, "-ERR", "protocol error: %s", line);
+		return (1);
+		}
+
+	if ((r = c_getrequest(ch, tag)) == NULL) {
+		printerror(1, "-ERR", "unexpected reply: %s", line);
+		return (1);
+		}
+
+	if (rc == 0  &&  (r->flags & C_STATUS) == R_MULTI) {
+
+		/*
+		 * Read the data response for the REQUEST
+		 * command.
+		 */
+
+		if ((r->flags & C_STREAM) != 0)
+			c_getstream(ch, r);
+		else
+			c_getdata(ch, r->reply);
+		}
+
+	/*
+	 * Read further responses from the first line
+	 * and interpret the commands.
+	 */
+
+	while (*(s = m_getword(&p, ';', response, sizeof(response))) != '\0') {
+		m_getword(&s, ' ', token, sizeof(token));
+		if (strcmp(token, "QUIT") == 0) {
+			__exit();
+			break;
+			}
+		else if (strcmp(token, "TTL") == 0)
+			r->ttl = atoi(s);
+		else if (strcmp(token, "PROTO") == 0) {
+			ch->proto = (atoi(s) >= 2)? 2: 1;
+			if (atoi(s) >= 3  &&  ch->sock >= 0)
+				ch->proto = 3;
+			}
+		else if (strcmp(token, "DIR") == 0)
+			c_getdir(ch);
+		else {
+			/* Again, terminate. */
+			printerror(1, "-ERR", "protocol error: %s", response);
+			rc = 1;
+			break;
+			}
+		}
+
+	c_complete(ch, r, rc);
+	return (rc);
+}
+
+static int c_message(chan_t *ch, char *line)
+{
+	char	*p, cmd[40], path[FILENAME_MAX];
+	buf_t	*b;
+	file_t	*f;
+
+	/*
+	 * Messages the controller sends on its own, they are not
+	 * a reply to any request:
+	 *
+	 *   PUSH path	new content for path in a data block
+	 *   INVAL path	the cached content of path is stale
+	 *   DIR	a block of file definitions
+	 */
+
+	p = line;
+	m_getword(&p, ' ', cmd, sizeof(cmd));
+	m_getword(&p, ' ', path, sizeof(path));
+
+	if (strcmp(cmd, "DIR") == 0)
+		return (c_getdir(ch));
+	else if (strcmp(cmd, "PUSH") == 0) {
+		b = b_alloc();
+		c_getdata(ch, b);
+		e_enter();
+		if ((f = getfile(&uxfs.dir, path, 0)) == NULL  ||
+		    (f->mode & M_DIR) != 0) {
+			printerror(0, "-INFO", "PUSH for unknown file: %s", path);
+			b_free(b);
+			}
+		else
+			f_push(f, b);
+
+		e_exit();
+		}
+	else if (strcmp(cmd, "INVAL") == 0) {
+		e_enter();
+		if ((f = getfile(&uxfs.dir, path, 0)) != NULL)
+			f_uncache(f);
+
+		e_exit();
+		}
+	else
+		return (-1);
+
+	return (0);
+}
+
+static void *c_reader(void *arg)
+{
+	char	line[LINE_MAX];
+	chan_t	*ch = arg;
+	req_t	*r;
+
+	/*
+	 * The reader thread owns the controller's output.  It
+	 * reads the replies and hands them over to the waiting
+	 * requests.
+	 */
+
+	while (c_gets(ch, line, sizeof(line), 1) != NULL) {
+		if (line[0] == '+'  ||  line[0] == '-')
+			c_reply(ch, line);
+		else if (c_message(ch, line) != 0)
+			printerror(1, "-ERR", "protocol error: %s", line);
+		}
+
+	/*
+	 * The controller is gone, don't leave anyone waiting.
+	 */
+
+	pthread_mutex_lock(&ch->lock);
+	while ((r = ch->pending) != NULL) {
+		ch->pending = r->next;
+		pthread_mutex_unlock(&ch->lock);
+		c_complete(ch, r, 1);
+		pthread_mutex_lock(&ch->lock);
+		}
+
+	pthread_mutex_unlock(&ch->lock);
+	return (NULL);
+}
+
+static chan_t *c_channel(const char *cmd, const char *path)
+{
+	int	idempotent;
+	unsigned int h;
+	file_t	*f;
+
+	/*
+	 * INIT and FILEOP change the namespace and go to the
+	 * primary controller.  Requests for idempotent files can
+	 * go to any controller, all other files stick to the one
+	 * that is selected by the path's hash because it might
+	 * keep the file's state.
+	 */
+
+	if (uxfs.co.jobs <= 1  ||  path == NULL  ||  *path == '\0'  ||
+	    strcmp(cmd, "INIT") == 0  ||  strcmp(cmd, "FILEOP") == 0)
+		return (&uxfs.co.ch[0]);
+
+	e_enter();
+	f = getfile(&uxfs.dir, path, 0);
+	idempotent = (f != NULL  &&  (f->mode & M_IDEMPOTENT) != 0);
+	e_exit();
+
+	if (idempotent != 0) {
+		h = __sync_fetch_and_add(&uxfs.co.rr, 1);
+		return (&uxfs.co.ch[h % uxfs.co.jobs]);
+		}
+
+	h = m_hash(path);
+	return (&uxfs.co.ch[h % uxfs.co.jobs]);
+}
+
+
+static struct iovec *c_iov(chan_t *ch, int count)
+{
+	if (count > ch->iov_size) {
+		ch->iov_size = 2 * count;
+		ch->iov = realloc(ch->iov, ch->iov_size * sizeof(struct iovec));
+		}
+
+	return (ch->iov);
+}
+
+  /*
+   * Requests are assembled in ch->out and ch->iov[].  Text goes
+   * to ch->out, data that is sent as it is gets an iov entry of
+   * its own.  The text entries get their address from c_flush()
+   * because ch->out may still move.
+   */
+
+static void c_piece(chan_t *ch, char *data, int len)
+{
+	struct iovec *iov;
+
+	if (ch->out.end > ch->mark) {
+		iov = c_iov(ch, ch->niov + 1);
+		iov[ch->niov].iov_base = NULL;
+		iov[ch->niov].iov_len  = ch->out.end - ch->mark;
+		ch->niov++;
+		ch->mark = ch->out.end;
+		}
+
+	if (len > 0) {
+		iov = c_iov(ch, ch->niov + 1);
+		iov[ch->niov].iov_base = data;
+		iov[ch->niov].iov_len  = len;
+		ch->niov++;
+		}
+}
+
+static int c_flush(chan_t *ch)
+{
+	int	i, rc = 0, k = 0;
+
+	c_piece(ch, NULL, 0);
+	for (i = 0; i < ch->niov; i++) {
+		if (ch->iov[i].iov_base == NULL) {
+			ch->iov[i].iov_base = &ch->out.buffer[k];
+			k += ch->iov[i].iov_len;
+			}
+		}
+
+	if (ch->niov > 0)
+		rc = c_write(ch, ch->iov, ch->niov);
+
+	ch->niov = 0;
+	ch->mark = 0;
+	b_clear(&ch->out);
+	return (rc);
+}
+
+static void c_putdata(chan_t *ch, buf_t *data)
+{
+	int	i, len, bol = 1;
+	char	*p, *q, *end, size[20];
+
+	/*
+	 * Protocol v2 sends the data as it is, after its length.
+	 * The data is not copied, its pieces follow the request
+	 * line in ch->iov[].
+	 */
+
+	if (ch->proto >= 3  &&  data->end >= MEMFD_MIN  &&
+	    c_putfd(ch, data) == 0) {
+		len = snprintf (size, sizeof(size), "@%d\n", data->end);
+		b_append(&ch->out, size, len);
+		return;
+		}
+	else if (ch->proto >= 2) {
+		len = snprintf (size, sizeof(size), "=%d\n", data->end);
+		b_append(&ch->out, size, len);
+		for (i = 0; (p = b_piece(data, i, &len)) != NULL; i++)
+			c_piece(ch, p, len);
+
+		return;
+		}
+
+	/*
+	 * Otherwise the dot-stuffed lines go to the output buffer.
+	 * Lines may continue from one piece to the next.
+	 */
+
+	for (i = 0; (p = b_piece(data, i, &len)) != NULL; i++) {
+		end = p + len;
+		while (p < end) {
+			if (bol != 0  &&  *p == '.')
+				b_append(&ch->out, ".", 1);
+
+			if ((q = memchr(p, '\n', end - p)) == NULL)
+				q = end - 1;
+
+			bol = (*q == '\n');
+			b_append(&ch->out, p, q + 1 - p);
+			p = q + 1;
+			}
+		}
+
+	if (bol == 0)
+		b_append(&ch->out, "\n", 1);
+
+	b_append(&ch->out, ".\n", 2);
+}
+
+static void c_request(chan_t *ch, req_t *r, const char *cmd,
+			const char *par, buf_t *data)
+{
+	char	tag[20];
+	req_t	**rp;
+
+	r->ch = ch;
+	if ((r->flags & C_STATUS) != R_NONE) {
+
+		/*
+		 * Register the request before it is sent, the reply
+		 * may be faster than we are.
+		 */
+
+		pthread_mutex_lock(&ch->lock);
+		r->tag = ++ch->tag_count;
+		for (rp = &ch->pending; *rp != NULL; rp = &(*rp)->next)
+			;
+
+		*rp = r;
+		if (++ch->waiting > ch->waiting_max)
+			ch->waiting_max = ch->waiting;
+		pthread_mutex_unlock(&ch->lock);
+		}
+
+	*tag = '\0';
+	if (uxfs.co.tagged != 0)
+		snprintf (tag, sizeof(tag) - 2, "#%d", r->tag);
+
+	if (cmd != NULL) {
+
+		/*
+		 * The command, parameter and data are appended to
+		 * the output, c_flush() sends it.
+		 */
+
+		if (par == NULL)
+			par = "";
+
+		if (uxfs.debug != 0)
+			fprintf (stderr, ">>%s %s%s %s\n", c_name(ch), cmd, tag, par);
+
+		if (rec.fp != NULL)
+			r_request(ch, r, cmd, par, data);
+
+		b_append(&ch->out, cmd, strlen(cmd));
+		b_append(&ch->out, tag, strlen(tag));
+		if (*par != '\0') {
+			b_append(&ch->out, " ", 1);
+			b_append(&ch->out, par, strlen(par));
+			}
+
+		b_append(&ch->out, "\n", 1);
+		if (data != NULL)
+			c_putdata(ch, data);
+		}
+}
+
+static void c_sent(chan_t *ch, req_t *r, int rc)
+{
+	int	found = 0;
+	req_t	**rp;
+
+	pthread_mutex_lock(&ch->lock);
+	if (rc <= 0  &&  (r->flags & C_STATUS) != R_NONE) {
+
+		/*
+		 * Sending failed, take the request back unless the
+		 * reader did already.
+		 */
+
+		for (rp = &ch->pending; *rp != NULL; rp = &(*rp)->next) {
+			if (*rp == r) {
+				*rp = r->next;
+				found = 1;
+				break;
+				}
+			}
+		}
+
+	/*
+	 * The worker may release the request as soon as it is
+	 * sent and complete, don't touch it afterwards.  Orphans
+	 * are freed by whoever comes last.
+	 */
+
+	r->sent = rc;
+	if (found != 0) {
+		pthread_mutex_unlock(&ch->lock);
+		c_complete(ch, r, 1);
+		}
+	else if (r->orphan != 0  &&  r->done != 0) {
+		pthread_mutex_unlock(&ch->lock);
+		c_free(r);
+		}
+	else {
+		pthread_cond_broadcast(&r->cond);
+		pthread_mutex_unlock(&ch->lock);
+		}
+}
+
+static void *c_writer(void *arg)
+{
+	int	rc;
+	chan_t	*ch = arg;
+	req_t	*r, *next, *list, *last;
+
+	/*
+	 * The writer thread owns the controller's input.  It sends
+	 * the queued requests in the order they came in, in untagged
+	 * mode only when the previous request is complete.
+	 */
+
+	while (1) {
+		if (sem_wait(&ch->queued) != 0  ||  ch->queue == NULL)
+			continue;
+
+		/*
+		 * With -b the writer collects tagged requests for a
+		 * moment and sends them with a single write.
+		 */
+
+		if (uxfs.co.tagged != 0  &&  uxfs.co.batch > 0)
+			usleep(uxfs.co.batch * 1000);
+
+		/*
+		 * The queue is a stack, newest first.  Each request
+		 * posted `queued` once, the posts of those taken
+		 * with this one are dropped.
+		 */
+
+		list = __sync_lock_test_and_set(&ch->queue, NULL);
+		for (r = NULL; list != NULL; list = next) {
+			next = list->qnext;
+			list->qnext = r;
+			r = list;
+			if (next != NULL)
+				sem_trywait(&ch->queued);
+			}
+
+		while (r != NULL) {
+			if (uxfs.co.tagged == 0) {
+				pthread_mutex_lock(&ch->lock);
+				while (ch->waiting > 0)
+					pthread_cond_wait(&ch->idle, &ch->lock);
+
+				pthread_mutex_unlock(&ch->lock);
+				}
+
+			for (last = r; ; last = last->qnext) {
+				c_request(ch, last, last->cmd, last->par, last->data);
+				if (uxfs.co.tagged == 0  ||  last->qnext == NULL)
+					break;
+				}
+
+			rc = (c_flush(ch) == 0)? 1: -1;
+			list = last->qnext;
+			for (; r != list; r = next) {
+				next = r->qnext;
+				c_sent(ch, r, rc);
+				}
+			}
+		}
+
+	return (NULL);
+}
+
+static int c_start_threads(chan_t *ch)
+{
+	if (ch->have_threads != 0)
+		return (0);
+
+	if (pthread_create(&ch->reader, NULL, c_reader, ch) != 0  ||
+	    pthread_create(&ch->writer, NULL, c_writer, ch) != 0) {
+		printerror(1, "-ERR", "can't create controller thread: %s",
+				strerror(errno));
+		return (1);
+		}
+
+	pthread_detach(ch->reader);
+	pthread_detach(ch->writer);
+	ch->have_threads = 1;
+	return (0);
+}
+
+static void c_queue(chan_t *ch, req_t *r)
+{
+	do {
+		r->qnext = ch->queue;
+		} while (__sync_bool_compare_and_swap(&ch->queue, r->qnext, r) == 0);
+
+	sem_post(&ch->queued);
+}
+
+  /*
+   * c_send() sends `cmd` with optional arguments (`formmat`
+   * parameter) to the controller and read the response
+   * inndicated by `resp` into `b`.
+   *
+   * The request is queued for the channel's writer thread and
+   * the caller waits until it is sent and, if a status is
+   * requested, until the reader thread has the reply.  In
+   * untagged mode the writer sends the next request only after
+   * that, so only one request is outstanding.
+   */
+
+static int c_send(chan_t *ch, const char *cmd, const char *par,
+			const int flags, buf_t *data, buf_t *reply)
+{
+	int	rc;
+	long long start = s_clock();
+	req_t	req;
+
+	memset(&req, 0, sizeof(req));
+	req.flags = flags;
+	req.reply = reply;
+	req.ttl   = -1;
+	req.cmd   = cmd;
+	req.par   = par;
+	req.data  = data;
+	pthread_cond_init(&req.cond, NULL);
+
+	c_queue(ch, &req);
+
+	/*
+	 * The data is needed until it is sent, even if the
+	 * controller replies before it has read all of it.
+	 */
+
+	pthread_mutex_lock(&ch->lock);
+	while (req.sent == 0  ||
+	    ((flags & C_STATUS) != R_NONE  &&  req.done == 0))
+		pthread_cond_wait(&req.cond, &ch->lock);
+
+	pthread_mutex_unlock(&ch->lock);
+	if ((flags & C_TEMP_DATA) != 0)
+		b_free(data);
+
+	if ((flags & C_STATUS) != R_NONE) {
+		rc = req.rc;
+		if (reply != NULL)
+			reply->ttl = req.ttl;
+		}
+	else
+		rc = (req.sent <= 0);
+
+	pthread_cond_destroy(&req.cond);
+	s_stop(S_CONTROLLER, start);
+	return (rc);
+}
+
+  /*
+   * c_putc() sends the request to the controller that is
+   * responsible for `par`.
+   */
+
+static int c_putc(const char *cmd, const char *par,
+			const int flags, buf_t *data, buf_t *reply) {
+	return (c_send(c_channel(cmd, par), cmd, par, flags, data, reply));
+}
+
+  /*
+   * c_stream() sends a READ request and returns without waiting
+   * for the reply, also in untagged mode.  The reader thread
+   * appends the data to `reply` as it comes in.
+   */
+
+static req_t *c_stream(const char *cmd, const char *par, buf_t *reply)
+{
+	req_t	*r;
+	chan_t	*ch = c_channel(cmd, par);
+
+	r = malloc(sizeof(req_t));
+	memset(r, 0, sizeof(req_t));
+	r->flags = R_MULTI | C_STREAM;
+	r->reply = reply;
+	r->ttl   = -1;
+	r->cmd   = cmd;
+	r->par   = par;
+	pthread_cond_init(&r->cond, NULL);
+
+	c_queue(ch, r);
+	pthread_mutex_lock(&ch->lock);
+	while (r->sent == 0)
+		pthread_cond_wait(&r->cond, &ch->lock);
+
+	pthread_mutex_unlock(&ch->lock);
+	return (r);
+}
+
+  /*
+   * c_prefetch() queues a READ for `f` that nobody waits for,
+   * the reply goes to the file's cache.
+   */
+
+static void c_prefetch(file_t *f, const char *path)
+{
+	req_t	*r;
+	chan_t	*ch = c_channel("READ", path);
+
+	r = malloc(sizeof(req_t) + strlen(path) + 1);
+	memset(r, 0, sizeof(req_t));
+	r->flags  = R_MULTI | C_PREFETCH;
+	r->reply  = b_alloc();
+	r->ttl    = -1;
+	r->orphan = 1;
+	r->file   = f;
+	r->cmd    = "READ";
+	r->par    = strcpy((char *) &r[1], path);
+	pthread_cond_init(&r->cond, NULL);
+
+	c_queue(ch, r);
+}
+
+
+
+
+/*
+ * Directory operations.
+ */
+
+static void d_retire(dir_t *d, void *p, int class)
+{
+	retired_t *r;
+
+	r = malloc(sizeof(retired_t));
+	r->p = p;
+	r->class = class;
+	r->next = d->retired;
+	d->retired = r;
+}
+
+  /*
+   * Growing a hash table moves its entries to other chains.  A
+   * lookup that overlaps with that may miss a file or, between
+   * the two tables, walk in a circle; the walks are bounded by
+   * the number of entries and d_retry() tells the lookup to
+   * start again.  Tables only grow: the size is stored after
+   * the table, so a reader that sees the new size also sees
+   * the new table.
+   */
+
+static unsigned int d_begin(dir_t *d)
+{
+	unsigned int seq;
+
+	while (((seq = __atomic_load_n(&d->seq, __ATOMIC_ACQUIRE)) & 1) != 0)
+		sched_yield();
+
+	return (seq);
+}
+
+static int d_retry(dir_t *d, unsigned int seq)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return (__atomic_load_n(&d->seq, __ATOMIC_RELAXED) != seq);
+}
+
+static name_t *d_name(dir_t *d, const char *s, int len, int add)
+{
+	unsigned int i, k, h, size;
+	name_t	*n, **name;
+
+	h = m_hash_len(s, len);
+	if ((size = __atomic_load_n(&d->name_size, __ATOMIC_ACQUIRE)) > 0) {
+		k = d->name_count + 1;
+		for (n = d->name[h & (size - 1)]; n != NULL  &&  k-- > 0; n = n->next) {
+			if (n->hash == h  &&  n->len == len  &&
+			    memcmp(n->s, s, len) == 0)
+				return (n);
+			}
+		}
+
+	if (add == 0)
+		return (NULL);
+
+	if (d->name_count >= d->name_size) {
+		k = (d->name_size == 0)? 64: 2 * d->name_size;
+		name = calloc(k, sizeof(name_t *));
+		d->seq++;
+		__sync_synchronize();
+		for (i = 0; i < d->name_size; i++) {
+			while ((n = d->name[i]) != NULL) {
+				d->name[i] = n->next;
+				n->next = name[n->hash & (k - 1)];
+				name[n->hash & (k - 1)] = n;
+				}
+			}
+
+		if (d->name != NULL)
+			d_retire(d, d->name, -1);
+
+		d->name = name;
+		__atomic_store_n(&d->name_size, k, __ATOMIC_RELEASE);
+		__sync_synchronize();
+		d->seq++;
+		}
+
+	k = (offsetof(name_t, s) + len + N_UNIT) / N_UNIT;
+	if (k < N_CLASSES  &&  d->name_free[k] != NULL) {
+		n = d->name_free[k];
+		d->name_free[k] = n->next;
+		}
+	else
+		n = a_alloc(&d->arena, k * N_UNIT);
+
+	n->hash = h;
+	n->refs = 0;
+	n->len  = len;
+	memcpy(n->s, s, len);
+	n->s[len] = '\0';
+
+	k = h & (d->name_size - 1);
+	n->next = d->name[k];
+	__sync_synchronize();
+	d->name[k] = n;
+	d->name_count++;
+
+	return (n);
+}
+
+static void d_name_release(dir_t *d, name_t *n)
+{
+	unsigned int k;
+	name_t	**p;
+
+	if (--n->refs > 0)
+		return;
+
+	p = &d->name[n->hash & (d->name_size - 1)];
+	while (*p != n)
+		p = &(*p)->next;
+
+	*p = n->next;
+	d->name_count--;
+
+	/*
+	 * Very long names are not reused, the others only when no
+	 * lookup can be on them anymore.
+	 */
+
+	k = (offsetof(name_t, s) + n->len + N_UNIT) / N_UNIT;
+	if (k < N_CLASSES)
+		d_retire(d, n, k);
+}
+
+static unsigned int d_hash(const file_t *parent, const name_t *n)
+{
+	return (n->hash ^ ((unsigned int) parent->inode * 2654435761U));
+}
+
+static void d_hash_insert(dir_t *d, file_t *f)
+{
+	unsigned int i, k;
+	file_t	*x, **hash;
+
+	/*
+	 * Grow the table when it gets full, the load factor
+	 * stays below 1.
+	 */
+
+	if (d->hash_count >= d->hash_size) {
+		k = (d->hash_size == 0)? 64: 2 * d->hash_size;
+		hash = calloc(k, sizeof(file_t *));
+		d->seq++;
+		__sync_synchronize();
+		for (i = 0; i < d->hash_size; i++) {
+			while ((x = d->hash[i]) != NULL) {
+				d->hash[i] = x->hnext;
+				x->hnext = hash[d_hash(x->parent, x->name) & (k - 1)];
+				hash[d_hash(x->parent, x->name) & (k - 1)] = x;
+				}
+			}
+
+		if (d->hash != NULL)
+			d_retire(d, d->hash, -1);
+
+		d->hash = hash;
+		__atomic_store_n(&d->hash_size, k, __ATOMIC_RELEASE);
+		__sync_synchronize();
+		d->seq++;
+		}
+
+	k = d_hash(f->parent, f->name) & (d->hash_size - 1);
+	f->hnext = d->hash[k];
+	__sync_synchronize();
+	d->hash[k] = f;
+	d->hash_count++;
+}
+
+static file_t *d_child(dir_t *d, const file_t *parent, const char *s, int len)
+{
+	unsigned int k, size;
+	name_t	*n;
+	file_t	*f;
+
+	if ((size = __atomic_load_n(&d->hash_size, __ATOMIC_ACQUIRE)) == 0  ||
+	    (n = d_name(d, s, len, 0)) == NULL)
+		return (NULL);
+
+	k = d->hash_count + 1;
+	f = d->hash[d_hash(parent, n) & (size - 1)];
+	for (; f != NULL  &&  k-- > 0; f = f->hnext) {
+		if (f->parent == parent  &&  f->name == n)
+			return (f);
+		}
+
+	return (NULL);
+}
+
+static file_t *d_lookup(dir_t *d, const char *path)
+{
+	unsigned int seq;
+	const char *p, *e;
+	file_t	*f;
+
+	/*
+	 * Called in e_enter().
+	 */
+
+	if (*path != '/')
+		return (NULL);
+
+	do {
+		seq = d_begin(d);
+		for (f = d->root, p = path; f != NULL; p = e) {
+			while (*p == '/')
+				p++;
+
+			if (*p == '\0')
+				break;
+			else if ((e = strchr(p, '/')) == NULL)
+				e = p + strlen(p);
+
+			f = d_child(d, f, p, e - p);
+			}
+		} while (d_retry(d, seq));
+
+	return (f);
+}
+
+static char *d_path(const file_t *f, char *path, int size)
+{
+	int	k = size - 1;
+
+	/*
+	 * The path is built from its end, up to the root.
+	 */
+
+	path[k] = '\0';
+	e_enter();
+	for (; f != NULL  &&  f->parent != NULL; f = f->parent) {
+		if ((k -= f->name->len + 1) < 0) {
+			e_exit();
+			*path = '\0';
+			return (path);
+			}
+
+		path[k] = '/';
+		memcpy(&path[k+1], f->name->s, f->name->len);
+		}
+
+	e_exit();
+
+	if (path[k] == '\0')
+		path[--k] = '/';
+
+	memmove(path, &path[k], size - k);
+	return (path);
+}
+
+static file_t *d_get_parent(dir_t *d, const char *path)
+{
+	char	*p, dn[FILENAME_MAX];
+
+	/*
+	 * Called in e_enter().
+	 */
+
+	LOG(P_VERBOSE, "d_get_parent(%s)", path);
+	m_copy(dn, path, sizeof(dn));
+	if ((p = strrchr(dn, '/')) == NULL)
+		return (NULL);
+	else if (p == dn)
+		p++;
+
+	*p = '\0';
+	return (d_lookup(d, dn));
+}
+
+  /*
+   * Each file keeps the attributes that getattr returns.  They
+   * are computed again whenever the file's mode, size or time
+   * changes, with the tree locked for writing.  Readers copy
+   * them without the lock and try again when `stseq` changed
+   * meanwhile.
+   */
+
+static void d_stat(file_t *f)
+{
+	int	perm = 0;
+	struct stat *st = &f->st;
+
+	f->stseq++;
+	__sync_synchronize();
+	memset(st, 0, sizeof(struct stat));
+	st->st_uid     = uxfs.uid;
+	st->st_gid     = uxfs.gid;
+	st->st_mtime   = f->mtime;
+	st->st_blksize = 512;
+	st->st_blocks  = 0;
+
+	/*
+	 * Set the file attributes.
+	 */
+
+	perm |= (f->mode & M_WRITE? S_IWUSR: 0);
+	perm |= (f->mode & M_READ?  S_IRUSR: 0);
+	st->st_ino = f->inode;
+
+	if (f->parent == NULL) {
+		st->st_mode = S_IFDIR | 0775;
+		st->st_nlink = 2;
+		st->st_blocks = 2;
+		st->st_size = 4096;
+		}
+	else if ((f->mode & M_DIR) != 0) {
+		st->st_mode = S_IFDIR | perm | S_IXUSR;
+		st->st_nlink = 2;
+		st->st_blocks = 2;
+		st->st_size = 4096;
+		}
+	else {
+		st->st_mode = S_IFREG | perm;
+		st->st_nlink = 1;
+
+		if (f->mode & (M_STATIC | M_USER)) {
+			if (f->buf != NULL)
+				st->st_size = f->buf->end;
+			}
+		}
+
+	if (uxfs.other_users) {
+		if (st->st_mode & S_IRUSR)
+			st->st_mode |= (S_IRGRP | S_IROTH);
+
+		if (st->st_mode & S_IWUSR)
+			st->st_mode |= (S_IWGRP | S_IWOTH);
+
+		if (st->st_mode & S_IXUSR)
+			st->st_mode |= (S_IXGRP | S_IXOTH);
+		}
+
+	__sync_synchronize();
+	f->stseq++;
+	k_inval(f, 0);
+}
+
+static int d_getattr(const file_t *f, struct stat *st)
+{
+	unsigned int seq;
+
+	if (f == NULL)
+		return (0);
+
+	do {
+		seq = __atomic_load_n(&f->stseq, __ATOMIC_ACQUIRE);
+		*st = f->st;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		} while ((seq & 1) != 0  ||
+			 __atomic_load_n(&f->stseq, __ATOMIC_RELAXED) != seq);
+
+	return (0);
+}
+
+static int d_get_modebits(const char *path, char *par)
+{
+	char	c;
+	int	i, mode = 0;
+
+	for (i = 0; (c = par[i]) != '\0'; i++) {
+		if (c == 'r')
+			mode |= M_READ;
+		else if (c == 'w')
+			mode |= M_WRITE;
+		else if (c == 'd')
+			mode |= M_DIR;
+		else if (c == 's')
+			mode |= (M_READ | M_WRITE | M_STATIC);
+		else if (c == 'i')
+			mode |= M_IDEMPOTENT;
+		else {
+			printerror(0, "-INFO", "bad mode \"%s\" for %s; assuming \"r\"",
+					par, path);
+			mode |= M_READ;
+			}
+		}
+
+	return (mode);
+}
+
+static char *d_get_mode(char *par, int size, int mode)
+{
+	int	k = 0;
+
+	par[k++] = mode & M_DIR?	'd': '-';
+	par[k++] = mode & M_READ?	'r': '-';
+	par[k++] = mode & M_WRITE?	'w': '-';
+	par[k++] = mode & M_STATIC?	's': '-';
+	par[k++] = mode & M_USER?	'u': '-';
+	par[k++] = mode & M_IDEMPOTENT?	'i': '-';
+	par[k]   = '\0';
+
+	return (par);
+}
+
+static void d_set_deleted(file_t *f, int deleted)
+{
+	if (f->deleted == deleted)
+		return;
+
+	f->deleted = deleted;
+	uxfs.dir.dead += (deleted != 0)? 1: -1;
+	if (f->parent != NULL)
+		f->parent->live += (deleted != 0)? -1: 1;
+}
+
+  /*
+   * Compaction: deleted files that are not open, not known to
+   * the kernel and have no (deleted) entries are removed from
+   * the tree, the hash index and the inode table.  They go to
+   * limbo.  A later compaction frees their data and puts them
+   * on the free list once no thread that could have looked
+   * them up is still in its epoch; files that are used beyond
+   * that hold a reference and are not unlinked.  A reused
+   * inode gets a new generation number, so the (inode,
+   * generation) pairs the kernel sees are never reused.
+   */
+
+static void d_unlink(dir_t *d, file_t *f)
+{
+	file_t	**p;
+
+	p = &d->hash[d_hash(f->parent, f->name) & (d->hash_size - 1)];
+	while (*p != f)
+		p = &(*p)->hnext;
+
+	*p = f->hnext;
+	d->hash_count--;
+
+	if (f->prev != NULL)
+		f->prev->next = f->next;
+	else
+		f->parent->child = f->next;
+
+	if (f->next != NULL)
+		f->next->prev = f->prev;
+
+	d->inode[f->inode] = NULL;
+	d->dead--;
+}
+
+static void d_compact(dir_t *d)
+{
+	int	i, k, n = 0;
+	file_t	*f;
+	retired_t *r;
+
+	s_wrlock();
+	if (d->compacting != 0  ||  d->dead < C_MIN_DEAD  ||
+	    (d->dead < C_MAX_DEAD  &&  d->dead * 4 < d->file_count)) {
+		pthread_rwlock_unlock(&lock);
+		return;
+		}
+
+	/*
+	 * Limbo is emptied only if no thread that entered its
+	 * epoch before the last compaction is still in it, else it
+	 * waits for the next one.
+	 */
+
+	d->compacting = 1;
+	if (e_quiet(d->limbo_epoch) != 0) {
+		while ((r = d->reclaim) != NULL) {
+			d->reclaim = r->next;
+			if (r->class < 0)
+				free(r->p);
+			else {
+				((name_t *) r->p)->next = d->name_free[r->class];
+				d->name_free[r->class] = r->p;
+				}
+
+			free(r);
+			}
+
+		while ((f = d->limbo) != NULL) {
+			d->limbo = f->lnext;
+			d_name_release(d, f->name);
+			if (f->buf != NULL)
+				b_free(f->buf);
+
+			if (f->cache != NULL)
+				b_free(f->cache);
+
+			f->lnext = d->free;
+			d->free  = f;
+			d->file_count--;
+			}
+		}
+
+	pthread_rwlock_unlock(&lock);
+
+	/*
+	 * The lock is released between the batches to let other
+	 * threads in.
+	 */
+
+	for (i = 2; i <= uxfs.inode_count; i += C_BATCH) {
+		s_wrlock();
+		for (k = i; k < i + C_BATCH  &&  k <= uxfs.inode_count; k++) {
+			if ((f = d->inode[k]) == NULL  ||  f->deleted == 0  ||
+			    f->used != 0  ||  f->nlookup != 0  ||
+			    f->child != NULL  ||  f->parent == NULL)
+				continue;
+
+			d_unlink(d, f);
+			f->lnext = d->limbo;
+			d->limbo = f;
+			n++;
+			}
+
+		pthread_rwlock_unlock(&lock);
+		}
+
+	/*
+	 * Names and tables that were released since the last
+	 * compaction join limbo.
+	 */
+
+	s_wrlock();
+	while ((r = d->retired) != NULL) {
+		d->retired = r->next;
+		r->next = d->reclaim;
+		d->reclaim = r;
+		}
+
+	d->limbo_epoch = e_advance();
+	d->compacting = 0;
+	pthread_rwlock_unlock(&lock);
+
+	LOG(P_VERBOSE, "d_compact(): %d files reclaimed", n);
+}
+
+static file_t *d_new(dir_t *d, file_t *parent,
+			const char *name, int len, int mode)
+{
+	file_t	*f;
+
+	f = f_alloc(d);
+	f->name  = d_name(d, name, len, 1);
+	f->name->refs++;
+	f->mode  = mode;
+	f->mtime = time(NULL);
+	f->used  = 0;
+	f->deleted = 0;
+
+	if (f->inode != 0)
+		f->generation = ++d->generation;
+	else
+		f->inode = ++uxfs.inode_count;
+
+	/*
+	 * The inode table is replaced, not resized, and grows by
+	 * half its size: the old tables stay until lookups are
+	 * done with them.
+	 */
+
+	if (f->inode >= d->inode_max) {
+		file_t	**inode;
+		int	max = d->inode_max + d->inode_max / 2 + 64;
+
+		inode = calloc(max, sizeof(file_t *));
+		if (d->inode != NULL) {
+			memcpy(inode, d->inode, d->inode_max * sizeof(file_t *));
+			d_retire(d, d->inode, -1);
+			}
+
+		d->inode = inode;
+		__atomic_store_n(&d->inode_max, max, __ATOMIC_RELEASE);
+		}
+
+	/*
+	 * The file is complete before lookups can find it.
+	 */
+
+	f->parent = parent;
+	d_stat(f);
+	__sync_synchronize();
+	d->inode[f->inode] = f;
+
+	/*
+	 * Link the file into its directory.
+	 */
+
+	if (parent != NULL) {
+		if ((f->next = parent->child) != NULL)
+			f->next->prev = f;
+
+		__sync_synchronize();
+		parent->child = f;
+		parent->live++;
+		d_hash_insert(d, f);
+		}
+
+	return (f);
+}
+
+static file_t *d_add(dir_t *d, const char *path, int mode)
+{
+	const char *p, *e;
+	file_t	*f, *x;
+
+	if (*path != '/')
+		return (NULL);
+	else if (d->root == NULL)
+		d->root = d_new(d, NULL, "", 0, M_DIR | M_READ);
+
+	/*
+	 * Walk down the path.  Missing directories are created
+	 * read-only and deleted ones are revived.  If the file
+	 * exists already only its mode changes.
+	 */
+
+	for (f = d->root, p = path; ; p = e) {
+		while (*p == '/')
+			p++;
+
+		if (*p == '\0')
+			break;
+		else if ((e = strchr(p, '/')) == NULL)
+			e = p + strlen(p);
+
+		if ((f->mode & M_DIR) == 0) {
+			printerror(0, "-ERR", "not a directory: %.*s",
+					(int) (p - path), path);
+			return (NULL);
+			}
+
+		if ((x = d_child(d, f, p, e - p)) == NULL)
+			x = d_new(d, f, p, e - p, M_DIR | M_READ);
+		else
+			d_set_deleted(x, 0);
+
+		f = x;
+		}
+
+	f->mode = mode;
+	d_stat(f);
+	return (f);
+}
+
+static file_t *add_file(dir_t *d, const char *path, int mode)
+{
+	file_t	*f;
+
+	if (strlen(path) >= FILENAME_MAX)
+		return (NULL);
+
+	/*
+	 * Correct some abvious mistakes.
+	 */
+
+	if ((mode & (M_WRITE | M_READ)) == 0)
+		mode |= M_READ;
+
+	if (mode & M_DIR)
+		mode |= M_READ;
+
+	s_wrlock();
+	f = d_add(d, path, mode);
+	pthread_rwlock_unlock(&lock);
+
+	if (f != NULL) {
+		LOG(P_VERBOSE, "add_file(): %s %d %d", path,
+				mode, f->inode);
+		}
+
+	return (f);
+}
+
+static int add_file_from_definition(char *line)
+{
+	int	mode, ttl = 0, stream = 0;
+	char	*p, *s, path[FILENAME_MAX], mode_par[20], word[40];
+	file_t	*f;
+
+	if (rec.fp != NULL)
+		r_file(line);
+
+	p = line;
+	m_getword(&p, ' ', path, sizeof(path));
+	m_getword(&p, ' ', mode_par, sizeof(mode_par));
+
+	/*
+	 * Optional attributes follow the mode.
+	 */
+
+	while (*m_getword(&p, ' ', word, sizeof(word)) != '\0') {
+		if (strncmp(word, "ttl=", 4) == 0)
+			ttl = atoi(&word[4]);
+		else if (strncmp(word, "stream=", 7) == 0) {
+			if (strchr(&word[7], 'r') != NULL)
+				stream |= M_STREAM_READ;
+
+			if (strchr(&word[7], 'w') != NULL)
+				stream |= M_STREAM_WRITE;
+			}
+		else
+			printerror(0, "-INFO", "unknown attribute \"%s\" for %s",
+					word, path);
+		}
+
+	if (*(s = m_trim(path, T_BOTH)) == '\0')
+		return (-1);
+	else if (*s != '/') {
+		printerror(0, "-ERR", "bad path: %s", path);
+		return (-1);
+		}
+	else if (strncmp(s, S_DIR, strlen(S_DIR)) == 0  &&
+		 (s[strlen(S_DIR)] == '\0'  ||  s[strlen(S_DIR)] == '/')) {
+		printerror(0, "-ERR", "reserved path: %s", path);
+		return (-1);
+		}
+
+	mode = d_get_modebits(path, mode_par) | stream;
+
+	/*
+	 * Check for directory.
+	 */
+
+	if (strcmp(path, "/") == 0)
+		mode |= M_DIR;
+	else if (path[ strlen(path) - 1 ] == '/') {
+		path[ strlen(path) - 1 ] = '\0';
+		mode |= M_DIR;
+		}
+	
+	if ((f = add_file(&uxfs.dir, path, mode)) == NULL)
+		return (-1);
+
+	f->ttl = ttl;
+	return (0);
+}
+
+  /*
+   * d_inode() and getfile() are called in e_enter(), the file
+   * they return is valid until e_exit().  Code that keeps it
+   * longer takes a reference (`used`, `nlookup`) first.
+   */
+
+static file_t *d_inode(dir_t *d, int inode)
+{
+	file_t	*f = NULL;
+
+	if (inode > 0  &&  inode < __atomic_load_n(&d->inode_max, __ATOMIC_ACQUIRE))
+		f = d->inode[inode];
+
+	return (f);
+}
+
+static file_t *getfile(dir_t *d, const char *path, int deleted)
+{
+	file_t	*f;
+
+	f = d_lookup(d, path);
+	if (f != NULL  &&  deleted == 0  &&  f->deleted != 0)
+		f = NULL;
+
+	return (f);
+}
+
+  /*
+   * Called in e_enter() and with the write lock: `f` is still
+   * the file at `path`.  A thread that looked it up before may
+   * find it deleted by another one meanwhile.
+   */
+
+static int d_still(dir_t *d, file_t *f, const char *path, int deleted)
+{
+	return (getfile(d, path, deleted) == f);
 }
 
 
 
 
-/*
- * Directory operations.
- */
+	/*
+	 * Function called from libfuse.
+	 */
 
-static int d_search_file(const dir_t *d, const char *path, int *pos)
+static file_t *f_alloc(dir_t *d)
 {
-	int	r = -2, k, left = 0, right = d->len - 1;
+	int	inode = 0;
 	file_t	*f;
 
-	if (d->len == 0) {
-		*pos = 0;
-		return (1);
+	if ((f = d->free) != NULL) {
+		d->free = f->lnext;
+		inode   = f->inode;
 		}
+	else
+		f = a_alloc(&d->arena, sizeof(file_t));
 
-	while (left <= right) {
-		*pos = k = (left + right) / 2;
-		f = d->file[k];
-
-		if ((r = strcmp(path, f->path)) == 0)
-			return (0);
-		else if (r < 0)
-			right = k - 1;
-		else
-			left = k + 1;
+	memset(f, 0, sizeof(file_t));
+	f->inode = inode;
+	d->file_count++;
+	return (f);
+}
 
-		f = NULL;
+static void f_clear(file_t *f)
+{
+	if (f->buf != NULL) {
+		b_free(f->buf);
+		f->buf = NULL;
 		}
+}
 
-	return (r);
+static int f_create(const char *path, file_t **f)
+{
+	file_t	*d;
+
+	/*
+	 * Called in e_enter().
+	 */
+
+	LOG(P_VERBOSE, "f_create(%s)", path);
+	*f = NULL;
+
+	/*
+	 * Check if the parent directory exists and allows
+	 * write access.
+	 */
+
+	if ((d = d_get_parent(&uxfs.dir, path)) == NULL  ||  d->deleted != 0)
+		return (-ENOENT);
+	else if ((d->mode & M_DIR) == 0)
+		return (-ENOTDIR);
+	else if ((d->mode & M_WRITE) == 0)
+		return (-EACCES);
+
+	if ((*f = add_file(&uxfs.dir, path, M_READ | M_WRITE | M_USER)) == NULL)
+		return (-ENAMETOOLONG);
+
+	return (0);
 }
 
-static int d_get_parent(const dir_t *d, const char *path, int *pos)
+  /*
+   * Read cache: the controller can declare how long the data
+   * it returns for a file is fresh, either with the ttl=
+   * attribute in the file's definition or with the TTL command
+   * in the READ reply.  Within that time opens are served from
+   * the cached copy.
+   */
+
+static int f_cached(file_t *f, buf_t *b)
 {
-	char	*p, dn[FILENAME_MAX];
+	int	hit = 0;
 
-	printerror(P_VERBOSE, "", "d_get_parent(%s)", path);
-	m_copy(dn, path, sizeof(dn));
-	//if ((p = strrchr(dn, '/')) == NULL  ||  p == dn)
-	//	return (-1);
-	if ((p = strrchr(dn, '/')) == NULL)
-		return (-1);
-	else if (p == dn)
-		p++;
+	s_rdlock();
+	if (f->cache != NULL  &&  m_now() < f->expires) {
+		b_copy(b, f->cache);
+		__sync_fetch_and_add(&uxfs.n_cache_hit, 1);
+		hit = 1;
+		}
+	else if (f->ttl > 0  ||  f->cache != NULL)
+		__sync_fetch_and_add(&uxfs.n_cache_miss, 1);
 
-	*p = '\0';
-	printerror(P_VERBOSE, "", "d_search_file(%s)", dn);
-	return (d_search_file(d, dn, pos));
+	pthread_rwlock_unlock(&lock);
+	return (hit);
 }
 
-static int d_getattr(const file_t *f, struct stat *st)
+static void f_cache(file_t *f, buf_t *b)
 {
-	int	perm = 0;
+	int	ttl;
 
 	/*
-	 * Set constant values.
+	 * Without TTL there is nothing to cache and, unless an
+	 * INVAL left a copy, nothing to drop.
 	 */
 
-	st->st_uid     = getuid();
-	st->st_gid     = getgid();
-	st->st_mtime   = f->mtime;
-	st->st_blksize = 512;
-	st->st_blocks  = 0;
+	ttl = (b->ttl >= 0)? b->ttl: f->ttl;
+	if (ttl <= 0  &&  f->cache == NULL)
+		return;
 
-	if (f == NULL)
-		return (0);
+	s_wrlock();
+	if (f->cache != NULL) {
+		b_free(f->cache);
+		f->cache = NULL;
+		}
+
+	if (ttl > 0) {
+		f->cache = b_copy(b_alloc(), b);
+		f->expires = m_now() + ttl;
+		}
+
+	pthread_rwlock_unlock(&lock);
+}
+
+static void f_push(file_t *f, buf_t *b)
+{
+	s_wrlock();
+	f->mtime = time(NULL);
 
 	/*
-	 * Set the file attributes.
+	 * Pushed content replaces the data of M_USER files and is
+	 * moved to chunks like written data.  For controller files
+	 * it is cached until the file's TTL expires or, without
+	 * TTL, until the controller sends INVAL or the file is
+	 * written.
 	 */
 
-	perm |= (f->mode & M_WRITE? S_IWUSR: 0);
-	perm |= (f->mode & M_READ?  S_IRUSR: 0);
-	st->st_ino = f->inode;
-
-	if (strcmp(f->path, "/") == 0) {
-		st->st_mode = S_IFDIR | 0775;
-		st->st_nlink = 2;
-		st->st_blocks = 2;
-		st->st_size = 4096;
-		}
-	else if ((f->mode & M_DIR) != 0) {
-		st->st_mode = S_IFDIR | perm | S_IXUSR;
-		st->st_nlink = 2;
-		st->st_blocks = 2;
-		st->st_size = 4096;
+	if ((f->mode & M_USER) != 0) {
+		b->mode = f->mode & (M_READ | M_WRITE | M_USER);
+		b_write(b, NULL, 0, 0);
+		b_buffer_to_file(f, b);
 		}
 	else {
-		st->st_mode = S_IFREG | perm;
-		st->st_nlink = 1;
+		if (f->cache != NULL)
+			b_free(f->cache);
 
-		if (f->mode & (M_STATIC | M_USER)) {
-			if (f->buf != NULL)
-				st->st_size = f->buf->end;
-			}
+		f->cache = b;
+		f->expires = (f->ttl > 0)? m_now() + f->ttl: T_NEVER;
 		}
 
-	if (uxfs.other_users) {
-		if (st->st_mode & S_IRUSR)
-			st->st_mode |= (S_IRGRP | S_IROTH);
-
-		if (st->st_mode & S_IWUSR)
-			st->st_mode |= (S_IWGRP | S_IWOTH);
+	d_stat(f);
+	pthread_rwlock_unlock(&lock);
+}
 
-		if (st->st_mode & S_IXUSR)
-			st->st_mode |= (S_IXGRP | S_IXOTH);
+static void f_uncache(file_t *f)
+{
+	s_wrlock();
+	if (f->cache != NULL) {
+		b_free(f->cache);
+		f->cache = NULL;
 		}
 
-	return (0);
+	pthread_rwlock_unlock(&lock);
 }
 
-static int d_get_modebits(const char *path, char *par)
-{
-	char	c;
-	int	i, mode = 0;
+  /*
+   * Reading an idempotent file with TTL reads its stale
+   * siblings of the same kind ahead.  In tagged mode their
+   * requests go out with this one and later opens find the
+   * data in the cache instead of waiting for the controller.
+   * The files are in use until the reply is in.
+   */
 
-	for (i = 0; (c = par[i]) != '\0'; i++) {
-		if (c == 'r')
-			mode |= M_READ;
-		else if (c == 'w')
-			mode |= M_WRITE;
-		else if (c == 'd')
-			mode |= M_DIR;
-		else if (c == 's')
-			mode |= (M_READ | M_WRITE | M_STATIC);
-		else {
-			printerror(0, "-INFO", "bad mode \"%s\" for %s; assuming \"r\"",
-					par, path);
-			mode |= M_READ;
+static void f_readahead(file_t *f)
+{
+	int	i, n = 0;
+	char	path[FILENAME_MAX];
+	long long now = m_now();
+	file_t	*s, *list[READAHEAD_MAX];
+
+	s_rdlock();
+	for (s = f->parent->child; s != NULL  &&  n < READAHEAD_MAX; s = s->next) {
+		if (s == f  ||  s->deleted != 0  ||  s->ttl <= 0)
+			continue;
+		else if ((s->mode & (M_READ | M_IDEMPOTENT | M_DIR | M_USER | M_STREAM_READ)) !=
+				(M_READ | M_IDEMPOTENT))
+			continue;
+		else if (s->cache != NULL  &&  now < s->expires)
+			continue;
+		else if (__sync_bool_compare_and_swap(&s->fetching, 0, 1) != 0) {
+			__sync_fetch_and_add(&s->used, 1);
+			list[n++] = s;
 			}
 		}
 
-	return (mode);
+	pthread_rwlock_unlock(&lock);
+	for (i = 0; i < n; i++) {
+		d_path(list[i], path, sizeof(path));
+		c_prefetch(list[i], path);
+		}
 }
 
-static char *d_get_mode(char *par, int size, int mode)
+static void f_prefetched(file_t *f, buf_t *b)
 {
-	int	k = 0;
-
-	par[k++] = mode & M_DIR?	'd': '-';
-	par[k++] = mode & M_READ?	'r': '-';
-	par[k++] = mode & M_WRITE?	'w': '-';
-	par[k++] = mode & M_STATIC?	's': '-';
-	par[k++] = mode & M_USER?	'u': '-';
-	par[k]   = '\0';
+	if (b != NULL  &&  f->deleted == 0)
+		f_cache(f, b);
 
-	return (par);
+	s_rdlock();
+	__sync_fetch_and_sub(&f->used, 1);
+	__sync_lock_release(&f->fetching);
+	pthread_rwlock_unlock(&lock);
 }
 
-static int add_file(dir_t *d, const char *path, int mode)
+static int f_open(file_t *f, int mode, struct fuse_file_info *fi)
 {
-	int	rc, k;
+	int	errno, m = 0;
+	char	path[FILENAME_MAX];
+	buf_t	*b;
+	req_t	*req = NULL;
+	handle_t *h;
 
-	if (strlen(path) > FILENAME_MAX)
-		return (-1);
+	d_path(f, path, sizeof(path));
+	LOG(P_VERBOSE, "f_open(%s, %d)", path, mode & O_ACCMODE);
+	errno = EACCES;
+	if ((mode & O_ACCMODE) == O_RDWR) {
+		/* allow opening a file for both */ ;
+		if ((f->mode & (M_WRITE | M_READ)) != (M_WRITE | M_READ))
+			return (-errno);
+
+		m = M_WRITE | M_READ;
+		}
+	else if ((mode & O_ACCMODE) == O_WRONLY) {
+		if ((f->mode & M_WRITE) == 0)
+			return (-errno);
+
+		m = M_WRITE;
+		}
+	else if ((mode & O_ACCMODE) == O_RDONLY) {
+		if ((f->mode & M_READ) == 0)
+			return (-errno);
 
-	pthread_mutex_lock(&lock);
+		m = M_READ;
+		}
 
 	/*
-	 * Correct some abvious mistakes.
+	 * Called in e_enter().  The file is in use from here, a
+	 * compaction that unlinked it in the meantime has found
+	 * it deleted.
 	 */
 
-	if ((mode & (M_WRITE | M_READ)) == 0)
-		mode |= M_READ;
+	s_rdlock();
+	if (f->deleted != 0) {
+		pthread_rwlock_unlock(&lock);
+		return (-ENOENT);
+		}
 
-	if (mode & M_DIR)
-		mode |= M_READ;
+	__sync_fetch_and_add(&f->used, 1);
+	pthread_rwlock_unlock(&lock);
+
+	b = b_alloc(sizeof(buf_t));
 
 	/*
-	 * Initialize some space if not already done ...
+	 * M_USER files have different properties: they can be
+	 * removed, "renamed" and their permission may change.
+	 *
+	 * They also have static content: Data that is written to
+	 * the file is send to the controller and following read()
+	 * operations read the file's content directly from the
+	 * buffer in file_t.
 	 */
 
-	if (d->max == 0) {
-		d->max = 10;
-		d->file = malloc(d->max * sizeof(file_t *));
-		}
+	b->mode = m | (f->mode & M_USER);
 
 	/*
-	 * ... and check if the file entry already exists.
+	 * The controller is not called with `lock` held: its reply
+	 * may define files and add_file() needs the lock too.
 	 */
 
-	if ((rc = d_search_file(d, path, &k)) == 0) {
-		/* File exists already. */
-		d->file[k]->mode = mode;
-		d->file[k]->deleted = 0;
-		}
-	else {
-		/*
-		 * README: All file entries in the filesystem are stored
-		 * in an array of pointers.  The array is sorted by the
-		 * file's path to have binary search in d_search_file().
-		 *
-		 * New elements are inserted into the array at their
-		 * correct location and consequently indices of following
-		 * file elements change.  In other words: a file's index
-		 * into the array is not constant but the pointer to
-		 * the file_t structure is.
-		 */
+	if ((b->mode & M_READ) != 0) {
+		if ((f->mode & M_USER) != 0) {
+			s_rdlock();
+			if (f->buf != NULL)
+				b_copy(b, f->buf);
 
-		/* Insert the new file. */
-		if (d->len == d->max) {
-			d->max += 20;
-			d->file = realloc(d->file, d->max * sizeof(file_t *));
+			pthread_rwlock_unlock(&lock);
+			b->mode = m | (f->mode & M_USER);
 			}
+		else if ((mode & O_ACCMODE) == O_RDONLY  &&
+		    (f->mode & M_USER) == 0) {
+			if ((f->mode & M_STATS) != 0)
+				s_report(b_clear(b));
+			else if (f_cached(f, b) != 0)
+				;
+			else if ((f->mode & M_STREAM_READ) != 0) {
+
+				/*
+				 * Streaming files are read while the
+				 * reply comes in, they are not cached.
+				 */
+
+				b->buffer = malloc(b->size = 512);
+				req = c_stream("READ", path, b);
+				}
+			else {
+				if (uxfs.co.tagged != 0  &&  f->ttl > 0  &&
+				    (f->mode & M_IDEMPOTENT) != 0)
+					f_readahead(f);
+
+				b->buffer = malloc(b->size = 512);
+				if (c_putc("READ", path, R_MULTI, NULL, b) != 0) {
+					__sync_fetch_and_sub(&f->used, 1);
+					b_free(b);
+					return (-EIO);
+					}
 
-		if (d->len > 0) {
-			if (rc > 0)
-				k++;
-
-			if (k < d->len) {
-				memmove(&d->file[k+1], &d->file[k],
-						(d->len - k) * sizeof(file_t *));
+				f_cache(f, b);
 				}
+
+			b->mode = m;
 			}
+		}
 
-		file_t *f = f_alloc();
-		strcpy(f->path, path);
-		f->mode  = mode;
-		f->mtime = time(NULL);
-		f->inode = ++uxfs.inode_count;
-		f->used  = 0;
-		f->deleted = 0;
+	h = malloc(sizeof(handle_t));
+	h->file = f;
+	h->buf  = b;
+	h->req  = req;
+	h->sent = 0;
+	h->wstream = ((mode & O_ACCMODE) == O_WRONLY  &&
+			(f->mode & (M_USER | M_STREAM_WRITE)) == M_STREAM_WRITE);
+	pthread_mutex_init(&h->lock, NULL);
 
-		d->file[k] = f;
-		d->len++;
-		}
+	/*
+	 * The kernel's copy of a user-created file is kept if the
+	 * data didn't change since the last open.  `version` only
+	 * changes under the write lock, concurrent opens swap
+	 * `kversion`.
+	 */
 
-	printerror(P_VERBOSE, "", "add_file(): %s %d %d (%d/%d)", path, mode,
-				d->file[k]->inode, k, d->len);
+	s_rdlock();
+	fi->fh = (unsigned long) h;
+	if (k_cached(f, mode) != 0)
+		fi->keep_cache = (__sync_lock_test_and_set(&f->kversion,
+					f->version) == f->version);
+	else
+		fi->direct_io = 1;
 
-	pthread_mutex_unlock(&lock);
-	return (k);
+	__sync_fetch_and_add(&uxfs.n_open, 1);
+
+	pthread_rwlock_unlock(&lock);
+	return (0);
 }
 
-static int add_file_from_definition(char *line)
+static void f_unuse(file_t *f)
 {
-	int	mode;
-	char	*p, *s, path[FILENAME_MAX], mode_par[20];
+	int	deleted;
 
-	p = line;
-	m_getword(&p, ' ', path, sizeof(path));
-	m_getword(&p, ' ', mode_par, sizeof(mode_par));
+	/*
+	 * The handle's reference is dropped last, the file may be
+	 * reclaimed after that.
+	 */
 
-	if (*(s = m_trim(path, T_BOTH)) == '\0')
-		return (-1);
-	else if (*s != '/') {
-		printerror(0, "-ERR", "bad path: %s", path);
-		return (-1);
+	s_wrlock();
+	f->used--;
+	deleted = f->deleted;
+	pthread_rwlock_unlock(&lock);
+
+	if (deleted != 0)
+		d_compact(&uxfs.dir);
+}
+
+static int f_release(handle_t *h)
+{
+	char	path[FILENAME_MAX];
+	file_t	*f = h->file;
+	buf_t	*b = h->buf;
+	req_t	*r = h->req;
+
+	/*
+	 * Reading a user-created file doesn't change it.
+	 */
+
+	s_wrlock();
+	if ((b->mode & M_WRITE) != 0  ||  (f->mode & M_USER) == 0) {
+		f->mtime = time(NULL);
+		d_stat(f);
 		}
 
-	mode = d_get_modebits(path, mode_par);
+	pthread_rwlock_unlock(&lock);
 
 	/*
-	 * Check for directory.
+	 * A stream that is still coming in is left to the reader
+	 * thread, it frees the request and the buffer.
 	 */
 
-	if (strcmp(path, "/") == 0)
-		mode |= M_DIR;
-	else if (path[ strlen(path) - 1 ] == '/') {
-		path[ strlen(path) - 1 ] = '\0';
-		mode |= M_DIR;
+	if (r != NULL) {
+		pthread_mutex_lock(&r->ch->lock);
+		if (r->done == 0) {
+			r->orphan = 1;
+			pthread_mutex_unlock(&r->ch->lock);
+			pthread_mutex_destroy(&h->lock);
+			free(h);
+			__sync_fetch_and_add(&uxfs.n_close, 1);
+			f_unuse(f);
+			return (0);
+			}
+
+		pthread_mutex_unlock(&r->ch->lock);
+		pthread_cond_destroy(&r->cond);
+		free(r);
 		}
-	
-	return (add_file(&uxfs.dir, path, mode));
+
+	if ((b->mode & M_WRITE) != 0  &&  h->wstream != 0) {
+
+		/*
+		 * The rest of a stream goes out and CLOSE marks its
+		 * end.
+		 */
+
+		f_uncache(f);
+		if (b->end > 0)
+			h_flush(h, 1);
+
+		c_putc("CLOSE", d_path(f, path, sizeof(path)), R_STATUS, NULL, NULL);
+		}
+	else if (b->mode & M_WRITE) {
+		f_uncache(f);
+		c_putc("WRITE", d_path(f, path, sizeof(path)), R_STATUS, b, NULL);
+		if (b->mode & M_USER) {
+			s_wrlock();
+			b = b_buffer_to_file(f, b);
+			d_stat(f);
+			pthread_rwlock_unlock(&lock);
+			}
+		}
+
+	b_free(b);
+	pthread_mutex_destroy(&h->lock);
+	free(h);
+	__sync_fetch_and_add(&uxfs.n_close, 1);
+	f_unuse(f);
+
+	return (0);
+}
+
+static int f_access(const file_t *f, int mode)
+{
+	struct stat sbuf;
+
+	e_enter();
+	d_getattr(f, &sbuf);
+	e_exit();
+
+	if ((mode & R_OK)  &&  (sbuf.st_mode & S_IRUSR) == 0)
+		return (-EACCES);
+
+	if ((mode & W_OK)  &&  (sbuf.st_mode & S_IWUSR) == 0)
+		return (-EACCES);
+
+	if ((mode & X_OK)  &&  (sbuf.st_mode & S_IXUSR) == 0)
+		return (-EACCES);
+
+	return (0);
 }
 
-static file_t *getfile(dir_t *d, const char *path, int deleted)
+static int h_flush(handle_t *h, int all)
 {
-	file_t	*f = NULL;
+	int	n, rc;
+	char	*p, path[FILENAME_MAX];
+	buf_t	*b = h->buf, chunk;
 
-	if (d->len == 0)
-		;
-	else if (d->len == 1) {
-		if (strcmp(d->file[0]->path, path) == 0)
-			f = d->file[0];
-		}
-	else {
-		int	k;
+	/*
+	 * Send the complete lines of a write stream, or all data
+	 * if there is a lot of it or the file is closed.
+	 */
 
-		if (d_search_file(d, path, &k) == 0)
-			f = d->file[k];
-		}
+	if (all != 0  ||  b->end >= STREAM_CHUNK)
+		n = b->end;
+	else if ((p = memrchr(b->buffer, '\n', b->end)) != NULL)
+		n = p - b->buffer + 1;
+	else
+		n = 0;
 
-	if (f != NULL  &&  deleted == 0  &&  f->deleted != 0)
-		f = NULL;
+	if (n == 0)
+		return (0);
 
-	return (f);
-}		
+	memset(&chunk, 0, sizeof(chunk));
+	chunk.buffer = b->buffer;
+	chunk.end    = n;
+	rc = c_putc("APPEND", d_path(h->file, path, sizeof(path)), R_STATUS,
+			&chunk, NULL);
 
+	memmove(b->buffer, &b->buffer[n], b->end - n);
+	b->end  -= n;
+	h->sent += n;
 
+	return (rc);
+}
+
+static int h_write(handle_t *h, const char *buf, size_t size, off_t offset)
+{
+	int	rc;
+	buf_t	*b = h->buf;
 
+	if ((b->mode & M_WRITE) == 0)
+		return (-EBADF);
 
 	/*
-	 * Function called from libfuse.
+	 * Write streams are sequential, the data is forwarded to
+	 * the controller as it comes in.
 	 */
 
-static file_t *f_alloc()
-{
-	file_t *f = malloc(sizeof(file_t));
-	memset(f, 0, sizeof(file_t));
-	return (f);
-}
+	if (h->wstream != 0) {
+		pthread_mutex_lock(&h->lock);
+		if (offset != h->sent + b->end)
+			rc = -ESPIPE;
+		else {
+			b_append(b, buf, size);
+			rc = (h_flush(h, 0) == 0)? size: -EIO;
+			}
 
-static void f_clear(file_t *f)
-{
-	if (f->buf != NULL) {
-		b_free(f->buf);
-		f->buf = NULL;
+		pthread_mutex_unlock(&h->lock);
+		return (rc);
 		}
+
+	if (offset + size > MAX_FILESIZE)
+		return (-EFBIG);
+
+	pthread_mutex_lock(&h->lock);
+	b_write(b, buf, size, offset);
+	pthread_mutex_unlock(&h->lock);
+	return (size);
 }
 
-static int f_create(const char *path, file_t **f)
+static int h_read(handle_t *h, char *buf, size_t size, off_t offset)
 {
-	int	k;
-	file_t	*d;
-
-	printerror(P_VERBOSE, "", "f_create(%s)", path);
-	*f = NULL;
+	int	n = 0;
+	buf_t	*b = h->buf;
+	req_t	*r = h->req;
 
 	/*
-	 * Check if the parent directory exists and allows
-	 * write access.
+	 * Streams return what has arrived and wait only if there
+	 * is nothing beyond `offset` yet.
 	 */
 
-	if (d_get_parent(&uxfs.dir, path, &k) != 0)
-		return (-ENOENT);
-		
-	d = uxfs.dir.file[k];
-	if ((d->mode & M_WRITE) == 0)
-		return (-EACCES);
+	if (r != NULL) {
+		pthread_mutex_lock(&r->ch->lock);
+		while (r->done == 0  &&  b->end <= offset)
+			pthread_cond_wait(&r->cond, &r->ch->lock);
 
-	k = add_file(&uxfs.dir, path, M_READ | M_WRITE | M_USER);
-	*f = uxfs.dir.file[k];
+		if ((n = b->end - offset) <= 0)
+			n = 0;
+		else {
+			if (size < n)
+				n = size;
 
-	return (0);
+			memmove(buf, &b->buffer[offset], n);
+			}
+
+		pthread_mutex_unlock(&r->ch->lock);
+		return (n);
+		}
+
+	pthread_mutex_lock(&h->lock);
+	if (offset < b->end)
+		n = b_read(b, buf, size, offset);
+
+	pthread_mutex_unlock(&h->lock);
+	return (n);
 }
 
-static int f_open(file_t *f, int mode, struct fuse_file_info *fi)
+static int d_readdir(file_t *d,
+			int (*fill)(void *ctx, const char *name, struct stat *st),
+			void *ctx)
 {
-	int	errno, m = 0;
-	buf_t	*b;
+	struct stat sbuf;
+	file_t	*f;
 
-	printerror(P_VERBOSE, "", "f_open(%s, %d)", f->path, mode & O_ACCMODE);
-	errno = EACCES;
-	if ((mode & O_ACCMODE) == O_RDWR) {
-		/* allow opening a file for both */ ;
-		if ((f->mode & (M_WRITE | M_READ)) != (M_WRITE | M_READ))
-			return (-errno);
+	if ((d->mode & M_DIR) == 0)
+		return (-ENOTDIR);
 
-		m = M_WRITE | M_READ;
-		}
-	else if ((mode & O_ACCMODE) == O_WRONLY) {
-		if ((f->mode & M_WRITE) == 0)
-			return (-errno);
+	e_enter();
+	for (f = d->child; f != NULL; f = f->next) {
+		if (f->deleted != 0)
+			continue;
 
-		m = M_WRITE;
+		d_getattr(f, &sbuf);
+		if (fill(ctx, f->name->s, &sbuf) != 0)
+			break;
 		}
-	else if ((mode & O_ACCMODE) == O_RDONLY) {
-		if ((f->mode & M_READ) == 0)
-			return (-errno);
 
-		m = M_READ;
-		}
+	e_exit();
+	return (0);
+}
 
-	pthread_mutex_lock(&lock);
 
-	b = b_alloc(sizeof(buf_t));
+static void u_init()
+{
+	int	k;
 
-	/*
-	 * M_USER files have different properties: they can be
-	 * removed, "renamed" and their permission may change.
-	 *
-	 * They also have static content: Data that is written to
-	 * the file is send to the controller and following read()
-	 * operations read the file's content directly from the
-	 * buffer in file_t.
-	 */
+	for (k = 0; k < uxfs.co.jobs; k++)
+		c_start_threads(&uxfs.co.ch[k]);
 
-	b->mode = m | (f->mode & M_USER);
+	c_putc("INIT", "", R_STATUS, NULL, NULL);
 
-	if ((b->mode & M_READ) != 0) {
-		if ((f->mode & M_USER) != 0  &&  f->buf != NULL) {
-			b_copy(b, f->buf);
-			b->mode = m | (f->mode & M_USER);
-			}
-		else
-			b->buffer = malloc(b->size = 512);
+	/*
+	 * If the primary controller switched to protocol v2 the
+	 * other copies are asked to do the same.
+	 */
 
-		if ((mode & O_ACCMODE) == O_RDONLY  &&
-		    (f->mode & M_USER) == 0) {
-			c_putc("READ", f->path, R_MULTI, NULL, b);
-			}
+	for (k = 1; k < uxfs.co.jobs  &&  uxfs.co.ch[0].proto >= 2; k++) {
+		c_send(&uxfs.co.ch[k], "PROTO",
+				(uxfs.co.ch[0].proto >= 3)? "3": "2",
+				R_STATUS, NULL, NULL);
 		}
-	else if ((b->mode & M_WRITE) != 0)
-		b->buffer = malloc(b->size = 512);
-
-	fi->fh = (unsigned long) b;
-	fi->direct_io = 1;
-	f->used++;
-	uxfs.n_open++;
-
-	pthread_mutex_unlock(&lock);
-	return (0);
 }
 
 
-static inline buf_t *get_file_ptr(struct fuse_file_info *fi)
+static inline handle_t *get_handle(struct fuse_file_info *fi)
 {
-	return (buf_t *) (uintptr_t) fi->fh;
+	return (handle_t *) (uintptr_t) fi->fh;
 }
 
 
 static void *do_init(struct fuse_conn_info *conn)
 {
-	uxfs.uid = getuid();
-	uxfs.gid = getgid();
+	uxfs.fuse = fuse_get_context()->fuse;
+	u_init();
 
-	c_putc("INIT", "", R_STATUS, NULL, NULL);
 	return (NULL);
 }
 
 static int do_getattr(const char *path, struct stat *st)
 {
+	int	rc = 0;
+	long long start = s_clock();
 	file_t	*f;
 
-	printerror(P_EXTRA, "", "do_getattr(%s)", path);
-	if ((f = getfile(&uxfs.dir, path, 0)) == NULL)
-		return (-ENOENT);
+	LOG(P_EXTRA, "do_getattr(%s)", path);
+	e_enter();
+	if ((f = d_lookup(&uxfs.dir, path)) == NULL  ||  f->deleted != 0)
+		rc = -ENOENT;
+	else
+		d_getattr(f, st);
 
-	d_getattr(f, st);
-	return (0);
+	e_exit();
+
+	s_stop(S_GETATTR, start);
+	if (rec.fp != NULL)
+		r_op(S_GETATTR, start, rc, NULL, path, NULL, NULL, 0, 0, 0);
+
+	return (rc);
 }
 
 static int do_create(const char *path, const mode_t mode,
 			struct fuse_file_info *fi)
 {
 	int	rc;
+	long long start = s_clock();
 	file_t	*f = NULL;
 
-	if ((rc = f_create(path, &f)) != 0)
+	e_enter();
+	if ((rc = f_create(path, &f)) != 0) {
+		e_exit();
 		return (rc);
+		}
+
+	rc = f_open(f, O_WRONLY, fi);
+	e_exit();
+
+	if (rec.fp != NULL)
+		r_op(S_CREATE, start, rc, NULL, path, NULL, get_handle(fi), 0, 0, O_WRONLY);
+
+	return (rc);
+}
+
+typedef struct _filler {
+    void		*buf;
+    fuse_fill_dir_t	filler;
+    } filler_t;
+
+static int do_fill(void *ctx, const char *name, struct stat *st)
+{
+	filler_t *fl = ctx;
 
-	return ( f_open(f, O_WRONLY, fi));
+	return (fl->filler(fl->buf, name, st, 0));
 }
 
 static int do_readdir(const char *path, void *buf,
 			fuse_fill_dir_t filler, off_t offset,
 			struct fuse_file_info *fi)
 {
-	int	k, len, sp;
-	char	*p;
-	struct stat sbuf;
-	file_t	*f;
+	int	rc;
+	long long start = s_clock();
+	filler_t fl;
+	file_t	*d;
 
-	printerror(P_EXTRA, "", "do_readdir(\"%s\")", path);
+	LOG(P_EXTRA, "do_readdir(\"%s\")", path);
+	e_enter();
+	if ((d = getfile(&uxfs.dir, path, 0)) == NULL) {
+		e_exit();
+		return (-ENOENT);
+		}
 
 	filler(buf, ".", NULL, 0);
 	filler(buf, "..", NULL, 0);
 
-	if (*path == '\0'  ||  d_search_file(&uxfs.dir, path, &k) != 0) {
-		errno = ENOENT;
-		return (-1);
-		}
-	else if ((uxfs.dir.file[k]->mode & M_DIR) == 0) {
-		errno = ENOTDIR;
-		return (-1);
-		}
-
-	len = strlen(path);
-	sp  = len;		/* Char at position sp must be `/' */
-	if (strcmp(path, "/") == 0)
-		sp = 0;
-
-	k++;
-	while (k < uxfs.dir.len) {
-		f = uxfs.dir.file[k++];
-		memset(&sbuf, 0, sizeof(sbuf));
-
-		/*
-		 * Skip the item if it is deleted.
-		 */
-
-		if (f->deleted != 0)
-			continue;
-
-		/*
-		 * Check if the item is inside the requested directory.
-		 */
-
-		else if (f->path[sp] != '/'  ||  strncmp(f->path, path, len) != 0)
-			break;
-
-
-		/*
-		 * There may be no other slash ...
-		 */
-
-		else if ((p = strchr(&f->path[sp+1], '/')) == NULL) {
-			/* TODO: Use __getattr(file_t *f, struct stat *) */
-			do_getattr(path, &sbuf);
-			if (filler(buf, &f->path[sp+1], &sbuf, 0) != 0)
-				break;
-			}
-
-		/*
-		 * ... or it must be the last character (then the
-		 * item is a directory).
-		 */
+	fl.buf    = buf;
+	fl.filler = filler;
+	rc = d_readdir(d, do_fill, &fl);
+	e_exit();
 
-		else if (p[1] == '\0') {
-			char	name[FILENAME_MAX];
+	s_stop(S_READDIR, start);
+	if (rec.fp != NULL)
+		r_op(S_READDIR, start, rc, NULL, path, NULL, NULL, 0, 0, 0);
 
-			d_getattr(f, &sbuf);
-			m_copy(name, &f->path[sp+1], sizeof(name));
-			name[ strlen(name) - 1 ] = '\0';
-			if (filler(buf, name, &sbuf, 0) != 0)
-				break;
-			}
-		}
-
-	return (0);
+	return (rc);
 }
 
 static int do_open(const char *path, struct fuse_file_info *fi)
 {
+	int	rc;
+	long long start = s_clock();
 	file_t	*f;
 
-	printerror(P_VERBOSE, "", "do_open(\"%s\")", path);
+	LOG(P_VERBOSE, "do_open(\"%s\")", path);
 	fi->fh = (unsigned long) NULL;
+	e_enter();
 	if ((f = getfile(&uxfs.dir, path, 0)) == NULL) {
-		if (do_create(path, 0, NULL) == 0)
+		e_exit();
+		if (do_create(path, 0, fi) == 0)
 			return (0);
 
 		// errno = ENOENT;
 		return (-ENOENT);
 		}
 	else if ((f->mode & M_DIR) != 0) {
+		e_exit();
 		return (-EISDIR);
 		}
 
- 	return ( f_open(f, fi->flags & O_ACCMODE, fi));
+ 	rc = f_open(f, fi->flags & O_ACCMODE, fi);
+	e_exit();
+
+	s_stop(S_OPEN, start);
+	if (rec.fp != NULL)
+		r_op(S_OPEN, start, rc, NULL, path, NULL, get_handle(fi), 0, 0, fi->flags);
+
+	return (rc);
 }
 
 static int do_release(const char *path, struct fuse_file_info *fi)
 {
-	file_t	*f;
-	buf_t	*b;
-
-	printerror(P_VERBOSE, "", "do_release(\"%s\")", path);
-	b = get_file_ptr(fi);
-	if ((f = getfile(&uxfs.dir, path, 1)) != NULL) {
-		f->mtime = time(NULL);
-		f->used--;
-
-		b->buffer[b->end] = '\0';
-		if (b->mode & M_WRITE) {
-			pthread_mutex_lock(&lock);
+	int	rc;
+	long long start = s_clock();
+	char	name[FILENAME_MAX];
+	handle_t *h = get_handle(fi);
 
-			c_putc("WRITE", f->path, R_STATUS, b, NULL);
-			if (b->mode & M_USER)
-				b = b_buffer_to_file(f, b);
+	/*
+	 * The file may be gone after f_release(), the recording
+	 * gets its path before.
+	 */
 
-			pthread_mutex_unlock(&lock);
-			}
-		}
+	LOG(P_VERBOSE, "do_release(\"%s\")", path);
+	if (rec.fp != NULL)
+		d_path(h->file, name, sizeof(name));
 
-	b_free(b);
-	uxfs.n_close++;
+	rc = f_release(h);
+	s_stop(S_RELEASE, start);
+	if (rec.fp != NULL)
+		r_op(S_RELEASE, start, rc, NULL, name, NULL, h, 0, 0, 0);
 
-	return (0);
+	return (rc);
 }
 
 static int do_truncate(const char *path, off_t size)
@@ -1273,78 +4279,58 @@ static int do_truncate(const char *path, off_t size)
 static int do_write(const char *path, const char *buf, size_t size,
 			off_t offset, struct fuse_file_info *fi)
 {
-	buf_t	*b;
-
-	printerror(P_EXTRA, "", "do_write(\"%s\", size= %d, offset= %d)", path, size, offset);
-
-	b = get_file_ptr(fi);
-	if ((b->mode & M_WRITE) == 0) {
-		errno = EBADF;
-		return (-1);
-		}
-
-	pthread_mutex_lock(&lock);
-	if (b->size < offset + size + 4) {
-		b->size += offset + size + 4 + 2048;
-		b->buffer = realloc(b->buffer, b->size);
-		}
+	int	rc;
+	long long start = s_clock();
 
-	memmove(&b->buffer[offset], buf, size);
-	if (b->end < offset + size)
-		b->end = offset + size;
+	LOG(P_EXTRA, "do_write(\"%s\", size= %d, offset= %d)", path, size, offset);
+	rc = h_write(get_handle(fi), buf, size, offset);
+	s_stop(S_WRITE, start);
+	if (rec.fp != NULL)
+		r_op(S_WRITE, start, rc, get_handle(fi)->file, NULL, NULL,
+				get_handle(fi), offset, size, 0);
 
-	pthread_mutex_unlock(&lock);
-	return (size);
+	return (rc);
 }
 
 static int do_read(const char *path, char *buf, size_t size, off_t offset,
                         struct fuse_file_info *fi)
 {
-	int	n = 0;
-
-	printerror(P_EXTRA, "", "do_read(size= %d, off= %d)", size, offset);
-	pthread_mutex_lock(&lock);
-
-	buf_t *b = get_file_ptr(fi);
-	if ((n = b->end - offset) <= 0)
-		n = 0;
-	else {
-		if (size < n)
-			n = size;
+	int	rc;
+	long long start = s_clock();
 
-		memmove(buf, &b->buffer[offset], n);
-		}
+	LOG(P_EXTRA, "do_read(size= %d, off= %d)", size, offset);
+	rc = h_read(get_handle(fi), buf, size, offset);
+	s_stop(S_READ, start);
+	if (rec.fp != NULL)
+		r_op(S_READ, start, rc, get_handle(fi)->file, NULL, NULL,
+				get_handle(fi), offset, size, 0);
 
-	pthread_mutex_unlock(&lock);
-	return (n);
+	return (rc);
 }
 
 static int do_access(const char *path, int mode)
 {
-	struct stat sbuf;
-
-	printerror(P_VERBOSE, "", "access(%s, mode= %d)", path, mode);
-	if (do_getattr(path, &sbuf) != 0)
-		return (-ENOENT);
-
-	if ((mode & R_OK)  &&  (sbuf.st_mode & S_IRUSR) == 0)
-		return (-EACCES);
-
-	if ((mode & W_OK)  &&  (sbuf.st_mode & S_IWUSR) == 0)
-		return (-EACCES);
+	int	rc;
+	file_t	*f;
 
-	if ((mode & X_OK)  &&  (sbuf.st_mode & S_IXUSR) == 0)
-		return (-EACCES);
+	LOG(P_VERBOSE, "access(%s, mode= %d)", path, mode);
+	e_enter();
+	if ((f = getfile(&uxfs.dir, path, 0)) == NULL)
+		rc = -ENOENT;
+	else
+		rc = f_access(f, mode);
 
-	return (0);
+	e_exit();
+	return (rc);
 }
 
 static int do_rename(const char *from, const char *to)
 {
-	int	rc;
+	int	rc = 0;
+	long long start = s_clock();
 	file_t	*src, *dst;
 
-	printerror(P_VERBOSE, "", "rename(from= %s, to= %s)", from, to);
+	LOG(P_VERBOSE, "rename(from= %s, to= %s)", from, to);
 
 	/*
 	 * Renaming a file is difficult.  First, the source file must
@@ -1352,158 +4338,192 @@ static int do_rename(const char *from, const char *to)
 	 * must be also M_USER and the directory must be writeable if
 	 * the file does not exist.
 	 *
-	 * When all conditions are met the file_t structure of dst
-	 * is free()'ed and src's file_t is copied over to dst.  Then
-	 * src is marked as deleted.
+	 * When all conditions are met src's data is moved over to
+	 * dst and src is marked as deleted.  Only the entries of
+	 * the two parent directories change.
 	 */
 
+	e_enter();
 	if ((src = getfile(&uxfs.dir, from, 0)) == NULL)
-		return (-ENOENT);
+		rc = -ENOENT;
 	else if (src->mode & M_DIR)
-		return (-EISDIR);	/* Only files can be moved. */
+		rc = -EISDIR;	/* Only files can be moved. */
 	else if ((src->mode & M_USER) == 0)
-		return (-EACCES);
-
-	if ((dst = getfile(&uxfs.dir, to, 1)) != NULL) {
-		if (dst->mode & M_DIR)
-			return (-EISDIR);
-		else if ((dst->mode & M_USER) == 0)
-			return (-EPERM);
-		}
-	else if ((rc = f_create(to, &dst)) == 0) {
-
-		/*
-		 * Recalculate because the pointer migth have changed.
-		 */
-
-		if ((src = getfile(&uxfs.dir, from, 0)) == NULL)
-			return (-EACCES);
-		}
-	else
+		rc = -EACCES;
+	else if ((dst = getfile(&uxfs.dir, to, 1)) == NULL)
+		rc = f_create(to, &dst);
+	else if (dst->mode & M_DIR)
+		rc = -EISDIR;
+	else if ((dst->mode & M_USER) == 0)
+		rc = -EPERM;
+
+	if (rc != 0) {
+		e_exit();
 		return (rc);
+		}
 
 	/*
 	 * Source and destination meet the requirements.
 	 */
 
-	pthread_mutex_lock(&lock);
 	c_putc("FILEOP", NULL, C_TEMP_DATA | R_STATUS,
 			b_from_strings(3, "rename", from, to), NULL);
 
+	s_wrlock();
+	if (d_still(&uxfs.dir, src, from, 0) == 0  ||
+	    d_still(&uxfs.dir, dst, to, 1) == 0) {
+		pthread_rwlock_unlock(&lock);
+		e_exit();
+		return (-ENOENT);
+		}
+
 	f_clear(dst);
 	dst->mode    = src->mode;
 	dst->mtime   = time(NULL);
-	dst->deleted = 0;
 	dst->buf     = src->buf;
+	dst->version++;
+	d_set_deleted(dst, 0);
+	d_stat(dst);
+	k_inval(dst, 1);
 
 	src->buf     = NULL;
-	src->deleted = 1;
+	d_set_deleted(src, 1);
+
+	pthread_rwlock_unlock(&lock);
+	e_exit();
+
+	d_compact(&uxfs.dir);
+
+	if (rec.fp != NULL)
+		r_op(S_RENAME, start, 0, NULL, from, to, NULL, 0, 0, 0);
 
-	pthread_mutex_unlock(&lock);
 	return (0);
 }
 
 static int do_unlink(const char *path)
 {
+	int	rc = 0;
+	long long start = s_clock();
 	file_t	*f;
 
-	printerror(P_VERBOSE, "", "unlink(path= %s)", path);
+	LOG(P_VERBOSE, "unlink(path= %s)", path);
+	e_enter();
 	if ((f = getfile(&uxfs.dir, path, 0)) == NULL)
-		return (-ENOENT);
+		rc = -ENOENT;
 	else if ((f->mode & M_USER) == 0)
-		return (-EPERM);
+		rc = -EPERM;
 	else if (f->mode & M_DIR)
-		return (-EISDIR);
+		rc = -EISDIR;
+
+	if (rc != 0) {
+		e_exit();
+		return (rc);
+		}
 
 	c_putc("FILEOP", NULL, C_TEMP_DATA | R_STATUS,
 			b_from_strings(2, "unlink", path), NULL);
 
-	f->deleted = 1;
+	s_wrlock();
+	if (d_still(&uxfs.dir, f, path, 0) == 0)
+		rc = -ENOENT;
+	else
+		d_set_deleted(f, 1);
+
+	pthread_rwlock_unlock(&lock);
+	e_exit();
+
+	if (rc != 0)
+		return (rc);
+
+	d_compact(&uxfs.dir);
+	if (rec.fp != NULL)
+		r_op(S_UNLINK, start, 0, NULL, path, NULL, NULL, 0, 0, 0);
+
 	return (0);
 }
 
 static int do_mkdir(const char *path, mode_t mode)
 {
 	int	rc;
+	long long start = s_clock();
 	file_t	*d;
 
-	printerror(P_VERBOSE, "", "mkdir(%s)", path);
-	if ((rc = f_create(path, &d)) != 0)
+	LOG(P_VERBOSE, "mkdir(%s)", path);
+	e_enter();
+	if ((rc = f_create(path, &d)) == 0) {
+		s_wrlock();
+		if (d_still(&uxfs.dir, d, path, 0) == 0)
+			rc = -ENOENT;
+		else {
+			d->mode = M_DIR | M_READ | M_WRITE | M_USER;
+			d_stat(d);
+			}
+
+		pthread_rwlock_unlock(&lock);
+		}
+
+	e_exit();
+	if (rc != 0)
 		return (rc);
 
-	d->mode = M_DIR | M_READ | M_WRITE | M_USER;
 	if (c_putc("FILEOP", NULL, C_TEMP_DATA | R_STATUS,
 			b_from_strings(2, "mkdir", path), NULL) != 0)
 		return (-EPERM);
 
+	if (rec.fp != NULL)
+		r_op(S_MKDIR, start, 0, NULL, path, NULL, NULL, 0, 0, 0);
+
 	return (0);
 }
 
 static int do_rmdir(const char *path)
 {
-	int	k, len, sp;
-	struct stat sbuf;
-	file_t	*f, *d;
-
-	printerror(P_EXTRA, "", "do_rmdir(\"%s\")", path);
-
-	if (*path == '\0'  ||  d_search_file(&uxfs.dir, path, &k) != 0)
-		return (-ENOENT);
-
-	d = uxfs.dir.file[k];
-	if ((d->mode & M_DIR) == 0)
-		return (-ENOTDIR);
-
-
-	/*
-	 * README: do_rmdir() (and do_readdir()) use the volatile
-	 * index into the directory array (instead of a pointer)
-	 * because they traverse their content.
-	 */
+	int	rc = 0;
+	long long start = s_clock();
+	file_t	*d;
 
-	len = strlen(path);
-	sp  = len;		/* Char at position sp must be `/' */
-	if (strcmp(path, "/") == 0)
-		sp = 0;
+	LOG(P_EXTRA, "do_rmdir(\"%s\")", path);
 
-	k++;
-	while (k < uxfs.dir.len) {
-		f = uxfs.dir.file[k++];
-		memset(&sbuf, 0, sizeof(sbuf));
+	e_enter();
+	if ((d = getfile(&uxfs.dir, path, 0)) == NULL)
+		rc = -ENOENT;
+	else if ((d->mode & M_DIR) == 0)
+		rc = -ENOTDIR;
+	else if (d->parent == NULL)
+		rc = -EBUSY;
+	else {
 
 		/*
-		 * Check if the item is in- our outside of our
-		 * directory.
+		 * The directory keeps count of its entries that
+		 * are not deleted.
 		 */
 
-		if (f->path[sp] == '/'  ||  strncmp(f->path, path, len) == 0) {
-
-			/*
-			 * If it is not deleted the directory is not empty.
-			 */
-
-			if (f->deleted == 0)
-				return (-ENOTEMPTY);
-			}
-		else {
-			/*
-			 * We reached the first item behind our directory
-			 * (tree), which meanss it is empty.
-			 */
+		s_wrlock();
+		if (d_still(&uxfs.dir, d, path, 0) == 0)
+			rc = -ENOENT;
+		else if (d->live != 0)
+			rc = -ENOTEMPTY;
+		else
+			d_set_deleted(d, 1);
 
-			break;
-			}
+		pthread_rwlock_unlock(&lock);
 		}
 
-	d->deleted = 1;
+	e_exit();
+	if (rc != 0)
+		return (rc);
+
 	if (c_putc("FILEOP", NULL, C_TEMP_DATA | R_STATUS,
 			b_from_strings(2, "rmdir", path), NULL) != 0)
 		return (-EPERM);
 
+	d_compact(&uxfs.dir);
+	if (rec.fp != NULL)
+		r_op(S_RMDIR, start, 0, NULL, path, NULL, NULL, 0, 0, 0);
+
 	return (0);
 }
 
-
 static int do_chmod(const char *path, mode_t mode)
 {
 	printerror(0, "-INFO", "not implemented: chmod(%s)", path);
@@ -1607,6 +4627,507 @@ static struct fuse_operations operations = {
 
 
 
+  /*
+   * libfuse low-level interface (option -l).  Requests address
+   * files by their inode number and after the lookup every
+   * operation finds its file_t in the inode table.
+   */
+
+static int ll_path(fuse_ino_t parent, const char *name, char *path, int size)
+{
+	int	k = 0, n;
+	file_t	*d;
+
+	/*
+	 * d_path() returns "" if the path doesn't fit.  The root's
+	 * path is "/", the name follows it directly.
+	 */
+
+	e_enter();
+	if ((d = d_inode(&uxfs.dir, parent)) == NULL)
+		k = -ENOENT;
+	else if ((d->mode & M_DIR) == 0)
+		k = -ENOTDIR;
+	else if ((k = strlen(d_path(d, path, size))) == 0)
+		k = -ENAMETOOLONG;
+	else if (k == 1)
+		k = 0;
+
+	e_exit();
+	if (k < 0)
+		return (k);
+
+	if (k + (n = strlen(name)) + 2 >= size)
+		return (-ENAMETOOLONG);
+
+	path[k] = '/';
+	memcpy(&path[k + 1], name, n + 1);
+	return (0);
+}
+
+static int ll_file_entry(file_t *f, struct fuse_entry_param *e)
+{
+	memset(e, 0, sizeof(*e));
+	s_rdlock();
+	if (f == NULL  ||  f->deleted != 0) {
+		pthread_rwlock_unlock(&lock);
+		return (-ENOENT);
+		}
+
+	/*
+	 * Each entry reply is a reference the kernel keeps until
+	 * it sends forget.  Names of user-created files are not
+	 * cached: rename moves the data to the file that has the
+	 * target name, not the file to the name as the kernel
+	 * thinks.
+	 */
+
+	__sync_fetch_and_add(&f->nlookup, 1);
+	e->ino = f->inode;
+	e->generation = f->generation;
+	e->attr_timeout  = uxfs.attr_timeout;
+	e->entry_timeout = ((f->mode & M_USER) != 0)? 0: uxfs.entry_timeout;
+	d_getattr(f, &e->attr);
+	pthread_rwlock_unlock(&lock);
+
+	return (0);
+}
+
+static int ll_entry(const char *path, struct fuse_entry_param *e)
+{
+	int	rc;
+
+	e_enter();
+	rc = ll_file_entry(getfile(&uxfs.dir, path, 0), e);
+	e_exit();
+
+	return (rc);
+}
+
+static void ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+	k_start();
+	u_init();
+}
+
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	int	rc;
+	unsigned int seq;
+	file_t	*d, *f;
+	struct fuse_entry_param e;
+
+	/*
+	 * The name is looked up directly in the parent directory.
+	 */
+
+	LOG(P_EXTRA, "ll_lookup(%lu, %s)", parent, name);
+	e_enter();
+	if ((d = d_inode(&uxfs.dir, parent)) == NULL)
+		rc = -ENOENT;
+	else if ((d->mode & M_DIR) == 0)
+		rc = -ENOTDIR;
+	else {
+		do {
+			seq = d_begin(&uxfs.dir);
+			f = d_child(&uxfs.dir, d, name, strlen(name));
+			} while (d_retry(&uxfs.dir, seq));
+
+		rc = ll_file_entry(f, &e);
+		}
+
+	e_exit();
+
+	if (rc != 0)
+		fuse_reply_err(req, -rc);
+	else
+		fuse_reply_entry(req, &e);
+}
+
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+	int	deleted = 0;
+	file_t	*f;
+
+	LOG(P_EXTRA, "ll_forget(%lu, %lu)", ino, nlookup);
+	e_enter();
+	if ((f = d_inode(&uxfs.dir, ino)) != NULL) {
+		deleted = f->deleted;
+		__sync_fetch_and_sub(&f->nlookup, nlookup);
+		}
+
+	e_exit();
+	if (deleted != 0)
+		d_compact(&uxfs.dir);
+
+	fuse_reply_none(req);
+}
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino,
+			struct fuse_file_info *fi)
+{
+	long long start = s_clock();
+	file_t	*f;
+	struct stat st;
+
+	LOG(P_EXTRA, "ll_getattr(%lu)", ino);
+	e_enter();
+	if ((f = d_inode(&uxfs.dir, ino)) == NULL) {
+		e_exit();
+		fuse_reply_err(req, ENOENT);
+		return;
+		}
+
+	d_getattr(f, &st);
+	fuse_reply_attr(req, &st, uxfs.attr_timeout);
+	s_stop(S_GETATTR, start);
+	if (rec.fp != NULL)
+		r_op(S_GETATTR, start, 0, f, NULL, NULL, NULL, 0, 0, 0);
+
+	e_exit();
+}
+
+static void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+			int to_set, struct fuse_file_info *fi)
+{
+	/*
+	 * Permissions and owners can't be changed, truncating
+	 * is accepted and ignored like do_truncate() does.
+	 */
+
+	if (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))
+		fuse_reply_err(req, EPERM);
+	else
+		ll_getattr(req, ino, fi);
+}
+
+static void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	int	rc;
+	long long start = s_clock();
+	file_t	*f;
+
+	LOG(P_VERBOSE, "ll_open(%lu)", ino);
+	e_enter();
+	if ((f = d_inode(&uxfs.dir, ino)) == NULL  ||  f->deleted != 0)
+		fuse_reply_err(req, ENOENT);
+	else if ((f->mode & M_DIR) != 0)
+		fuse_reply_err(req, EISDIR);
+	else if ((rc = f_open(f, fi->flags & O_ACCMODE, fi)) != 0)
+		fuse_reply_err(req, -rc);
+	else {
+		fuse_reply_open(req, fi);
+		s_stop(S_OPEN, start);
+		if (rec.fp != NULL)
+			r_op(S_OPEN, start, 0, f, NULL, NULL, get_handle(fi), 0, 0, fi->flags);
+		}
+
+	e_exit();
+}
+
+static void ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+			mode_t mode, struct fuse_file_info *fi)
+{
+	int	rc;
+	long long start = s_clock();
+	char	path[FILENAME_MAX];
+	file_t	*f;
+	struct fuse_entry_param e;
+
+	LOG(P_VERBOSE, "ll_create(%lu, %s)", parent, name);
+	e_enter();
+	if ((rc = ll_path(parent, name, path, sizeof(path))) != 0  ||
+	    (rc = f_create(path, &f)) != 0  ||
+	    (rc = f_open(f, O_WRONLY, fi)) != 0) {
+		e_exit();
+		fuse_reply_err(req, -rc);
+		return;
+		}
+
+	ll_file_entry(f, &e);
+	e_exit();
+
+	fuse_reply_create(req, &e, fi);
+	if (rec.fp != NULL)
+		r_op(S_CREATE, start, 0, NULL, path, NULL, get_handle(fi), 0, 0, O_WRONLY);
+}
+
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+			struct fuse_file_info *fi)
+{
+	int	n;
+	long long start = s_clock();
+	char	*buf;
+
+	LOG(P_EXTRA, "ll_read(%lu, size= %d, off= %d)", ino, size, off);
+	buf = malloc(size);
+	if ((n = h_read(get_handle(fi), buf, size, off)) < 0)
+		fuse_reply_err(req, -n);
+	else
+		fuse_reply_buf(req, buf, n);
+
+	free(buf);
+	s_stop(S_READ, start);
+	if (rec.fp != NULL)
+		r_op(S_READ, start, n, get_handle(fi)->file, NULL, NULL,
+				get_handle(fi), off, size, 0);
+}
+
+static void ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+			size_t size, off_t off, struct fuse_file_info *fi)
+{
+	int	n;
+	long long start = s_clock();
+
+	LOG(P_EXTRA, "ll_write(%lu, size= %d, off= %d)", ino, size, off);
+	if ((n = h_write(get_handle(fi), buf, size, off)) < 0)
+		fuse_reply_err(req, -n);
+	else
+		fuse_reply_write(req, n);
+
+	s_stop(S_WRITE, start);
+	if (rec.fp != NULL)
+		r_op(S_WRITE, start, n, get_handle(fi)->file, NULL, NULL,
+				get_handle(fi), off, size, 0);
+}
+
+static void ll_release(fuse_req_t req, fuse_ino_t ino,
+			struct fuse_file_info *fi)
+{
+	int	rc;
+	long long start = s_clock();
+	char	path[FILENAME_MAX];
+	handle_t *h = get_handle(fi);
+
+	LOG(P_VERBOSE, "ll_release(%lu)", ino);
+	if (rec.fp != NULL)
+		d_path(h->file, path, sizeof(path));
+
+	rc = f_release(h);
+	fuse_reply_err(req, -rc);
+	s_stop(S_RELEASE, start);
+	if (rec.fp != NULL)
+		r_op(S_RELEASE, start, rc, NULL, path, NULL, h, 0, 0, 0);
+}
+
+typedef struct _dirbuf {
+    fuse_req_t	req;
+    buf_t	*b;
+    } dirbuf_t;
+
+static int ll_fill(void *ctx, const char *name, struct stat *st)
+{
+	size_t	n;
+	dirbuf_t *db = ctx;
+	buf_t	*b = db->b;
+
+	n = fuse_add_direntry(db->req, NULL, 0, name, NULL, 0);
+	if (b->end + n > b->size) {
+		b->size = 2 * b->size + n;
+		b->buffer = realloc(b->buffer, b->size);
+		}
+
+	fuse_add_direntry(db->req, &b->buffer[b->end], b->size - b->end,
+			name, st, b->end + n);
+	b->end += n;
+
+	return (0);
+}
+
+static void ll_opendir(fuse_req_t req, fuse_ino_t ino,
+			struct fuse_file_info *fi)
+{
+	int	rc;
+	long long start = s_clock();
+	char	path[FILENAME_MAX];
+	file_t	*d;
+	dirbuf_t db;
+	struct stat st;
+
+	/*
+	 * The directory listing is created at opendir() and
+	 * readdir() returns it in pieces.
+	 */
+
+	LOG(P_EXTRA, "ll_opendir(%lu)", ino);
+	e_enter();
+	if ((d = d_inode(&uxfs.dir, ino)) == NULL  ||  d->deleted != 0) {
+		e_exit();
+		fuse_reply_err(req, ENOENT);
+		return;
+		}
+
+	db.req = req;
+	db.b   = b_clear(b_alloc());
+
+	memset(&st, 0, sizeof(st));
+	st.st_mode = S_IFDIR;
+	ll_fill(&db, ".", &st);
+	ll_fill(&db, "..", &st);
+	if ((rc = d_readdir(d, ll_fill, &db)) != 0) {
+		e_exit();
+		b_free(db.b);
+		fuse_reply_err(req, -rc);
+		return;
+		}
+
+	if (rec.fp != NULL)
+		d_path(d, path, sizeof(path));
+
+	e_exit();
+
+	fi->fh = (unsigned long) db.b;
+	fuse_reply_open(req, fi);
+	s_stop(S_READDIR, start);
+	if (rec.fp != NULL)
+		r_op(S_READDIR, start, 0, NULL, path, NULL, NULL, 0, 0, 0);
+}
+
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+			off_t off, struct fuse_file_info *fi)
+{
+	buf_t	*b = (buf_t *) (uintptr_t) fi->fh;
+
+	if (off >= b->end)
+		fuse_reply_buf(req, NULL, 0);
+	else {
+		if (size > b->end - off)
+			size = b->end - off;
+
+		fuse_reply_buf(req, &b->buffer[off], size);
+		}
+}
+
+static void ll_releasedir(fuse_req_t req, fuse_ino_t ino,
+			struct fuse_file_info *fi)
+{
+	b_free((buf_t *) (uintptr_t) fi->fh);
+	fuse_reply_err(req, 0);
+}
+
+static void ll_access(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+	int	rc;
+	file_t	*f;
+
+	e_enter();
+	if ((f = d_inode(&uxfs.dir, ino)) == NULL)
+		rc = -ENOENT;
+	else
+		rc = f_access(f, mask);
+
+	e_exit();
+	fuse_reply_err(req, -rc);
+}
+
+static void ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+			mode_t mode)
+{
+	int	rc;
+	char	path[FILENAME_MAX];
+	struct fuse_entry_param e;
+
+	if ((rc = ll_path(parent, name, path, sizeof(path))) != 0  ||
+	    (rc = do_mkdir(path, mode)) != 0  ||
+	    (rc = ll_entry(path, &e)) != 0)
+		fuse_reply_err(req, -rc);
+	else
+		fuse_reply_entry(req, &e);
+}
+
+static void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	int	rc;
+	char	path[FILENAME_MAX];
+
+	if ((rc = ll_path(parent, name, path, sizeof(path))) == 0)
+		rc = do_unlink(path);
+
+	fuse_reply_err(req, -rc);
+}
+
+static void ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	int	rc;
+	char	path[FILENAME_MAX];
+
+	if ((rc = ll_path(parent, name, path, sizeof(path))) == 0)
+		rc = do_rmdir(path);
+
+	fuse_reply_err(req, -rc);
+}
+
+static void ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+			fuse_ino_t newparent, const char *newname)
+{
+	int	rc;
+	char	from[FILENAME_MAX], to[FILENAME_MAX];
+
+	if ((rc = ll_path(parent, name, from, sizeof(from))) == 0  &&
+	    (rc = ll_path(newparent, newname, to, sizeof(to))) == 0)
+		rc = do_rename(from, to);
+
+	fuse_reply_err(req, -rc);
+}
+
+static struct fuse_lowlevel_ops ll_operations = {
+    .init		= ll_init,
+    .lookup		= ll_lookup,
+    .forget		= ll_forget,
+    .getattr		= ll_getattr,
+    .setattr		= ll_setattr,
+    .open		= ll_open,
+    .create		= ll_create,
+    .read		= ll_read,
+    .write		= ll_write,
+    .release		= ll_release,
+    .opendir		= ll_opendir,
+    .readdir		= ll_readdir,
+    .releasedir		= ll_releasedir,
+    .access		= ll_access,
+
+    .mkdir		= ll_mkdir,
+    .unlink		= ll_unlink,
+    .rmdir		= ll_rmdir,
+    .rename		= ll_rename,
+    };
+
+static int ll_main(struct fuse_args *args)
+{
+	int	rc = 1, multithreaded = 0, foreground = 0;
+	char	*mountpoint = NULL;
+
+	if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) != 0)
+		return (1);
+
+	if ((uxfs.chan = fuse_mount(mountpoint, args)) == NULL)
+		return (1);
+
+	uxfs.se = fuse_lowlevel_new(args, &ll_operations,
+			sizeof(ll_operations), NULL);
+	if (uxfs.se != NULL) {
+		if (fuse_set_signal_handlers(uxfs.se) == 0) {
+			fuse_session_add_chan(uxfs.se, uxfs.chan);
+			if (multithreaded != 0)
+				rc = fuse_session_loop_mt(uxfs.se);
+			else
+				rc = fuse_session_loop(uxfs.se);
+
+			fuse_remove_signal_handlers(uxfs.se);
+			fuse_session_remove_chan(uxfs.chan);
+			}
+
+		fuse_session_destroy(uxfs.se);
+		}
+
+	fuse_unmount(mountpoint, uxfs.chan);
+	free(mountpoint);
+
+	return (rc != 0);
+}
+
+
+
 static int uxfs_opt_proc(void *data, const char *arg, int key,
 				struct fuse_args *outargs)
 {
@@ -1649,6 +5170,14 @@ static int uxfs_opt_proc(void *data, const char *arg, int key,
 		uxfs.single_thread = 1;
 		break;
 
+	case OPT_TAGGED:
+		uxfs.co.tagged = 1;
+		break;
+
+	case OPT_LOWLEVEL:
+		uxfs.lowlevel = 1;
+		break;
+
 	default:
 		printerror(1, "-ERR", "internal error");
 		abort();
@@ -1660,18 +5189,21 @@ static int uxfs_opt_proc(void *data, const char *arg, int key,
 
 int main(int argc, char *argv[])
 {
-	int	rc = 0, k = 1;
+	int	rc = 0, i, k = 1;
 
 
 	memset(&uxfs, 0, sizeof(uxfs_t));
-	uxfs.inode_count = 1;
-	uxfs.co.fd0 = 0;
-	uxfs.co.fd1 = 1;
+	uxfs.inode_count = 0;	/* The root is inode 1 (FUSE_ROOT_ID) */
+	uxfs.co.ch[0].fd0 = 0;
+	uxfs.co.ch[0].fd1 = 1;
+	uxfs.attr_timeout = 1.0;	/* -c */
 
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 	if (fuse_opt_parse(&args, &uxfs, uxfs_opts, uxfs_opt_proc) == -1)
 		exit (1);
 
+	uxfs.entry_timeout = uxfs.attr_timeout;
+
 
 	fuse_opt_insert_arg(&args, k++, "-f");
 
@@ -1686,24 +5218,67 @@ int main(int argc, char *argv[])
 			fuse_opt_insert_arg(&args, k++, "allow_root");
 		}
 
-	if (pthread_mutex_init(&lock, NULL) != 0)
+	/*
+	 * Without a command the controller is on stdio and there
+	 * is only one of it.
+	 */
+
+	if (uxfs.co.argc == 0  ||  uxfs.co.jobs < 1)
+		uxfs.co.jobs = 1;
+	else if (uxfs.co.jobs > MAX_JOBS)
+		uxfs.co.jobs = MAX_JOBS;
+
+	if (pthread_rwlock_init(&lock, NULL) != 0)
 		printerror(1, "-ERR", "mutex init failed");
 
+	for (i = 0; i < uxfs.co.jobs; i++) {
+		uxfs.co.ch[i].num = i;
+		uxfs.co.ch[i].sock = -1;
+		if (pthread_mutex_init(&uxfs.co.ch[i].lock, NULL) != 0  ||
+		    pthread_cond_init(&uxfs.co.ch[i].idle, NULL) != 0  ||
+		    sem_init(&uxfs.co.ch[i].queued, 0, 0) != 0)
+			printerror(1, "-ERR", "mutex init failed");
+		}
+
 	printerror(0, "+INFO", "starting");
 
 	if (uxfs.co.argc > 0) {
 		uxfs.co.argv[uxfs.co.argc] = NULL;
-		c_start_server();
+		for (i = 0; i < uxfs.co.jobs; i++)
+			c_start_server(&uxfs.co.ch[i]);
 		}
 
+	uxfs.uid = getuid();
+	uxfs.gid = getgid();
 	add_file(&uxfs.dir, "/", M_DIR);
+	add_file(&uxfs.dir, S_FILE, M_READ | M_STATS);
+	uxfs.started = m_now();
+	if (uxfs.record != NULL  &&  r_open(uxfs.record) != 0)
+		exit (1);
 
+	if (uxfs.lowlevel != 0)
+		rc = ll_main(&args);
+	else {
 #if FUSE_VERSION >= 26
-	rc = fuse_main(args.argc, args.argv, &operations, NULL);
+		rc = fuse_main(args.argc, args.argv, &operations, NULL);
 #else
-	rc = fuse_main(args.argc, args.argv, &operations);
+		rc = fuse_main(args.argc, args.argv, &operations);
 #endif
+		}
 
+	printerror(P_VERBOSE, "+INFO", "%d opens, %d closes, read cache: %d hits, %d misses",
+			uxfs.n_open, uxfs.n_close,
+			uxfs.n_cache_hit, uxfs.n_cache_miss);
+	printerror(P_VERBOSE, "+INFO", "controller I/O: %d writes, %d reads",
+			uxfs.n_write, uxfs.n_read);
+	printerror(P_VERBOSE, "+INFO", "%u files (%u deleted), %u names, %lu bytes in arena, %lu bytes in tables",
+			uxfs.dir.file_count, uxfs.dir.dead, uxfs.dir.name_count,
+			(unsigned long) uxfs.dir.arena.total,
+			(unsigned long) (uxfs.dir.inode_max * sizeof(file_t *) +
+				uxfs.dir.hash_size * sizeof(file_t *) +
+				uxfs.dir.name_size * sizeof(name_t *)));
+
+	r_close();
 	fuse_opt_free_args(&args);
 	return (rc);
 }